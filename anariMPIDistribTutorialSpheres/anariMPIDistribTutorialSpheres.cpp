@@ -82,17 +82,19 @@ int main(int argc, char **argv)
   int currentSpp = 1;
   if (mpiRank == 0) {
     glfwANARIWindow->registerImGuiCallback(
-        [&]() { ImGui::SliderInt("pixelSamples", &spp, 1, 64); });
+        [&]() {
+          if (ImGui::SliderInt("pixelSamples", &spp, 1, 64))
+            glfwANARIWindow->setPixelSamples(spp);
+        });
   }
 
   glfwANARIWindow->registerDisplayCallback(
         [&](GLFWDistribANARIWindow *win) {
-          // Send the UI changes out to the other ranks so we can synchronize
-          // how many samples per-pixel we're taking
-          MPI_Bcast(&spp, 1, MPI_INT, 0, MPI_COMM_WORLD);
-          if (spp != currentSpp) {
-            currentSpp = spp;
-            anari::setParameter(device, renderer, "pixelSamples", spp);
+          // The UI changes reach the other ranks with the window state,
+          // so all ranks take the same number of samples per-pixel
+          if (win->getPixelSamples() != currentSpp) {
+            currentSpp = win->getPixelSamples();
+            anari::setParameter(device, renderer, "pixelSamples", currentSpp);
             win->addObjectToCommit(renderer);
           }
         });
@@ -1,6 +1,7 @@
 // https://github.com/ospray/ospray/blob/master/modules/mpi/tutorials/ospMPIDistribTutorial.cpp
 
 #include <errno.h>
+#include <stdlib.h>
 #include <mpi.h>
 
 #define STB_IMAGE_WRITE_IMPLEMENTATION
@@ -25,6 +26,16 @@ inline float3 randomColor(unsigned idx)
                 (b&255)/255.f);
 }
 
+static void usage(int mpiRank)
+{
+  if (mpiRank == 0) {
+    std::cerr << "Usage: ./anariMPIDistribTutorialTriangleMesh file.tri "
+              << "[-mmap|-mpiio] [-strategy kd|wkd|rr]\n";
+  }
+  MPI_Finalize();
+  exit(1);
+}
+
 int main(int argc, char **argv)
 {
   int mpiThreadCapability = 0;
@@ -40,10 +51,34 @@ int main(int argc, char **argv)
   auto device = anari::newDevice(library, "default");
   anari::commitParameters(device, device);
 
+  std::string fileName;
+  auto mode = util::PartitionedMeshLoader::Mode::Stream;
+  auto strategy = util::Partitioner::Strategy::KD;
+  for (int i=1;i<argc;i++) {
+    const std::string arg = argv[i];
+    if (arg[0] != '-')
+      fileName = arg;
+    else if (arg == "-mmap")
+      mode = util::PartitionedMeshLoader::Mode::Mapped;
+    else if (arg == "-mpiio")
+      mode = util::PartitionedMeshLoader::Mode::MPIIO;
+    else if (arg == "-strategy") {
+      if (i+1 >= argc)
+        usage(mpiRank);
+      const std::string s = argv[++i];
+      if (s == "kd")
+        strategy = util::Partitioner::Strategy::KD;
+      else if (s == "wkd")
+        strategy = util::Partitioner::Strategy::WeightedKD;
+      else if (s == "rr")
+        strategy = util::Partitioner::Strategy::RoundRobin;
+    }
+  }
+
   box3 bounds;
-  util::PartitionedMeshLoader loader;
+  util::PartitionedMeshLoader loader(mode, strategy);
   auto anariGeoms = loader.loadANARI(
-      device, argv[1], mpiRank, mpiWorldSize, &bounds);
+      device, fileName, mpiRank, mpiWorldSize, &bounds);
 
   std::vector<anari::Surface> surfaces;
   for (auto geom : anariGeoms) {
@@ -60,6 +95,13 @@ int main(int argc, char **argv)
   auto world = anari::newObject<anari::World>(device);
   auto surfs = anari::newArray1D(device, surfaces.data(), surfaces.size());
   anari::setAndReleaseParameter(device, world, "surface", surfs);
+
+  // Specify the region of the world this rank owns
+  box3 regionBounds = loader.regionBounds(mpiRank);
+  if (regionBounds.lower.x <= regionBounds.upper.x) {
+    anari::setParameter(device, world, "region", ANARI_FLOAT32_BOX3, &regionBounds);
+  }
+
   anari::commitParameters(device, world);
 
   // image size
@@ -84,6 +126,16 @@ int main(int argc, char **argv)
   anari::setParameter(device, camera, "up", cam.getUp());
   anari::commitParameters(device, camera); // commit each object to indicate modifications are done
 
+  // The ranks' regions in front-to-back order, as seen from the camera
+  if (mpiRank == 0 && loader.partitioner) {
+    loader.partitioner->printStats();
+    loader.partitioner->computeCompositeOrder(cam.getEye());
+    std::cout << "Composite order:";
+    for (auto rankID : loader.partitioner->compositeOrder)
+      std::cout << ' ' << rankID;
+    std::cout << '\n';
+  }
+
   // create the default renderer
   auto renderer = anari::newObject<anari::Renderer>(device, "default");
   anari::commitParameters(device, renderer);
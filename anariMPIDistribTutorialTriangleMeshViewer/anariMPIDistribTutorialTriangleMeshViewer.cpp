@@ -0,0 +1,275 @@
+/* Interactive viewer for the partitioned .tri files written by chopSuey.
+ * Rank 0 shows the UI, all ranks load and render their share of the
+ * clusters. With -rebalance, per-rank render times are measured and the
+ * clusters are redistributed among the ranks when the load is imbalanced.
+ * With -accumulate spp [variance], rendering stops once the image has
+ * converged, until the camera or the scene changes. With -frameTime ms,
+ * frames are rendered at a lower resolution while the camera moves.
+ */
+
+#include <imgui.h>
+#include <mpi.h>
+#include <cstdlib>
+#include <iostream>
+#include <map>
+#include <vector>
+#include "GLFWDistribANARIWindow.h"
+#include "PartitionedMeshLoader.h"
+#include "anari/anari_cpp.hpp"
+#include "anari/anari_cpp/ext/linalg.h"
+#include "statusFunc.h"
+
+using namespace anari;
+using namespace util;
+using namespace anari::math;
+
+inline float3 randomColor(unsigned idx)
+{
+  unsigned int r = (unsigned int)(idx*13*17 + 0x234235);
+  unsigned int g = (unsigned int)(idx*7*3*5 + 0x773477);
+  unsigned int b = (unsigned int)(idx*11*19 + 0x223766);
+  return float3((r&255)/255.f,
+                (g&255)/255.f,
+                (b&255)/255.f);
+}
+
+anari::Surface makeSurface(
+    anari::Device device, const util::Geometry::SP &geom, unsigned clusterID);
+
+void updateWorld(anari::Device device,
+    anari::World world,
+    const std::map<unsigned, anari::Surface> &surfaces,
+    const box3 &regionBounds);
+
+static void usage(int mpiRank)
+{
+  if (mpiRank == 0) {
+    std::cerr << "Usage: ./anariMPIDistribTutorialTriangleMeshViewer file.tri "
+              << "[-mpiio] [-strategy kd|wkd|rr] [-rebalance [threshold]] "
+              << "[-accumulate spp [variance]] [-frameTime ms]\n";
+  }
+  MPI_Finalize();
+  exit(1);
+}
+
+int main(int argc, char **argv)
+{
+  int mpiThreadCapability = 0;
+  MPI_Init_thread(&argc, &argv, MPI_THREAD_MULTIPLE, &mpiThreadCapability);
+  if (mpiThreadCapability != MPI_THREAD_MULTIPLE
+      && mpiThreadCapability != MPI_THREAD_SERIALIZED) {
+    fprintf(stderr,
+        "ANARI requires the MPI runtime to support thread "
+        "multiple or thread serialized.\n");
+    return 1;
+  }
+
+  int mpiRank = 0;
+  int mpiWorldSize = 0;
+  MPI_Comm_rank(MPI_COMM_WORLD, &mpiRank);
+  MPI_Comm_size(MPI_COMM_WORLD, &mpiWorldSize);
+
+  std::string fileName;
+  auto mode = PartitionedMeshLoader::Mode::Stream;
+  auto strategy = Partitioner::Strategy::KD;
+  bool rebalance = false;
+  float rebalanceThreshold = 1.2f;
+  int accumulationSpp = 0;
+  float accumulationVariance = 0.f;
+  float targetFrameTime = 0.f;
+  for (int i=1;i<argc;i++) {
+    const std::string arg = argv[i];
+    if (arg[0] != '-')
+      fileName = arg;
+    else if (arg == "-mpiio")
+      mode = PartitionedMeshLoader::Mode::MPIIO;
+    else if (arg == "-strategy") {
+      if (i+1 >= argc)
+        usage(mpiRank);
+      const std::string s = argv[++i];
+      if (s == "kd")
+        strategy = Partitioner::Strategy::KD;
+      else if (s == "wkd")
+        strategy = Partitioner::Strategy::WeightedKD;
+      else if (s == "rr")
+        strategy = Partitioner::Strategy::RoundRobin;
+    }
+    else if (arg == "-rebalance") {
+      rebalance = true;
+      if (i+1 < argc && argv[i+1][0] != '-')
+        rebalanceThreshold = std::stof(argv[++i]);
+    }
+    else if (arg == "-accumulate") {
+      if (i+1 >= argc)
+        usage(mpiRank);
+      accumulationSpp = std::stoi(argv[++i]);
+      if (i+1 < argc && argv[i+1][0] != '-')
+        accumulationVariance = std::stof(argv[++i]);
+    }
+    else if (arg == "-frameTime") {
+      if (i+1 >= argc)
+        usage(mpiRank);
+      targetFrameTime = std::stof(argv[++i]) / 1000.f;
+    }
+  }
+
+  auto library = anari::loadLibrary("environment", statusFunc);
+
+  auto device = anari::newDevice(library, "default");
+  anari::commitParameters(device, device);
+
+  // Clusters are migrated between ranks when rebalancing, so we need
+  // the mesh data on the host (no mapped mode here)
+  PartitionedMeshLoader loader(mode, strategy);
+  Mesh::SP mesh = loader.load(fileName, mpiRank, mpiWorldSize);
+  if (!mesh) {
+    MPI_Abort(MPI_COMM_WORLD, 1);
+  }
+
+  std::map<unsigned, anari::Surface> surfaces;
+  for (size_t i=0; i<mesh->geoms.size(); ++i) {
+    unsigned clusterID = loader.loadedClusters[i];
+    surfaces[clusterID] = makeSurface(device, mesh->geoms[i], clusterID);
+  }
+
+  auto world = anari::newObject<anari::World>(device);
+
+  // create and setup a directional light
+  auto light = anari::newObject<anari::Light>(device, "directional");
+  anari::setParameter(device, light, "direction", float3(-1.f, -1.f, 0.5f));
+  anari::commitParameters(device, light);
+  anari::setParameterArray1D(device, world, "light", &light, 1);
+
+  updateWorld(device, world, surfaces, loader.regionBounds(mpiRank));
+
+  // create ANARI renderer
+  auto renderer = anari::newObject<anari::Renderer>(device, "default");
+
+  auto glfwANARIWindow =
+      std::unique_ptr<GLFWDistribANARIWindow>(new GLFWDistribANARIWindow(
+          int2{1024, 768}, mesh->bounds, device, world, renderer));
+
+  int spp = 1;
+  int currentSpp = 1;
+  if (mpiRank == 0) {
+    glfwANARIWindow->registerImGuiCallback(
+        [&]() {
+          if (ImGui::SliderInt("pixelSamples", &spp, 1, 64))
+            glfwANARIWindow->setPixelSamples(spp);
+          ImGui::Text("accumulated: %d frames, %d spp",
+              glfwANARIWindow->getAccumulatedFrames(),
+              glfwANARIWindow->getAccumulatedSamples());
+        });
+  }
+
+  glfwANARIWindow->setAccumulationTarget(accumulationSpp, accumulationVariance);
+  glfwANARIWindow->setTargetFrameTime(targetFrameTime);
+
+  glfwANARIWindow->registerDisplayCallback(
+        [&](GLFWDistribANARIWindow *win) {
+          // The UI changes reach the other ranks with the window state,
+          // so all ranks take the same number of samples per-pixel
+          if (win->getPixelSamples() != currentSpp) {
+            currentSpp = win->getPixelSamples();
+            anari::setParameter(device, renderer, "pixelSamples", currentSpp);
+            win->addObjectToCommit(renderer);
+          }
+        });
+
+  if (rebalance) {
+    glfwANARIWindow->registerRebalanceCallback(
+        [&](const std::vector<float> &rankTimes) {
+          auto migration =
+              loader.rebalance(mesh, rankTimes, mpiRank, mpiWorldSize);
+
+          // Only rebuild the surfaces that moved
+          for (auto clusterID : migration.removed) {
+            anari::release(device, surfaces[clusterID]);
+            surfaces.erase(clusterID);
+          }
+
+          for (size_t i=0; i<mesh->geoms.size(); ++i) {
+            unsigned clusterID = loader.loadedClusters[i];
+            if (surfaces.find(clusterID) == surfaces.end())
+              surfaces[clusterID] = makeSurface(device, mesh->geoms[i], clusterID);
+          }
+
+          if (!migration.added.empty() || !migration.removed.empty()) {
+            updateWorld(device, world, surfaces, loader.regionBounds(mpiRank));
+            glfwANARIWindow->addObjectToCommit(world);
+          }
+
+          if (mpiRank == 0) {
+            loader.partitioner->printStats();
+          }
+        },
+        rebalanceThreshold);
+  }
+
+  // start the GLFW main loop, which will continuously render
+  glfwANARIWindow->mainLoop();
+
+  glfwANARIWindow.reset();
+
+  for (auto &s : surfaces) {
+    anari::release(device, s.second);
+  }
+  anari::release(device, light);
+  anari::release(device, renderer);
+  anari::release(device, world);
+  anari::release(device, device);
+
+  anari::unloadLibrary(library);
+
+  MPI_Finalize();
+
+  return 0;
+}
+
+anari::Surface makeSurface(
+    anari::Device device, const util::Geometry::SP &geom, unsigned clusterID)
+{
+  auto ageom = anari::newObject<anari::Geometry>(device, "triangle");
+
+  anari::Array1D data;
+  data = anari::newArray1D(device, geom->vertex.data(), geom->vertex.size());
+  anari::setAndReleaseParameter(device, ageom, "vertex.position", data);
+
+  data = anari::newArray1D(device, (uint3 *)geom->index.data(), geom->index.size());
+  anari::setAndReleaseParameter(device, ageom, "primitive.index", data);
+
+  anari::commitParameters(device, ageom);
+
+  auto material = anari::newObject<anari::Material>(device, "matte");
+  anari::setParameter(device, material, "color", randomColor(clusterID));
+  anari::commitParameters(device, material);
+
+  auto surface = anari::newObject<anari::Surface>(device);
+  anari::setAndReleaseParameter(device, surface, "geometry", ageom);
+  anari::setAndReleaseParameter(device, surface, "material", material);
+  anari::commitParameters(device, surface);
+
+  return surface;
+}
+
+void updateWorld(anari::Device device,
+    anari::World world,
+    const std::map<unsigned, anari::Surface> &surfaces,
+    const box3 &regionBounds)
+{
+  std::vector<anari::Surface> surfs;
+  for (auto &s : surfaces) {
+    surfs.push_back(s.second);
+  }
+  anari::setParameterArray1D(device, world, "surface", surfs.data(), surfs.size());
+
+  // Specify the region of the world this rank owns; after rebalancing,
+  // a rank may own nothing anymore
+  if (regionBounds.lower.x <= regionBounds.upper.x) {
+    anari::setParameter(device, world, "region", ANARI_FLOAT32_BOX3, &regionBounds);
+  } else {
+    anari::unsetParameter(device, world, "region");
+  }
+
+  anari::commitParameters(device, world);
+}
@@ -0,0 +1,177 @@
+// https://github.com/ospray/ospray/blob/master/modules/mpi/tutorials/ospMPIDistribTutorial.cpp
+
+#include <errno.h>
+#include <stdlib.h>
+#include <mpi.h>
+
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#include "stb_image_write.h"
+
+#include "anari/anari_cpp.hpp"
+#include "anari/anari_cpp/ext/linalg.h"
+
+#include "statusFunc.h"
+#include "PartitionedVolumeLoader.h"
+#include "Camera.h"
+
+using namespace anari::math;
+
+static void usage(int mpiRank)
+{
+  if (mpiRank == 0) {
+    std::cerr << "Usage: ./anariMPIDistribTutorialVolume file.vols "
+              << "[-mpiio] [-strategy kd|wkd|rr]\n";
+  }
+  MPI_Finalize();
+  exit(1);
+}
+
+int main(int argc, char **argv)
+{
+  MPI_Init(&argc, &argv);
+
+  int mpiRank = 0;
+  int mpiWorldSize = 0;
+  MPI_Comm_rank(MPI_COMM_WORLD, &mpiRank);
+  MPI_Comm_size(MPI_COMM_WORLD, &mpiWorldSize);
+
+  auto library = anari::loadLibrary("environment", statusFunc);
+
+  auto device = anari::newDevice(library, "default");
+  anari::commitParameters(device, device);
+
+  std::string fileName;
+  auto mode = util::PartitionedVolumeLoader::Mode::Stream;
+  auto strategy = util::Partitioner::Strategy::KD;
+  for (int i=1;i<argc;i++) {
+    const std::string arg = argv[i];
+    if (arg[0] != '-')
+      fileName = arg;
+    else if (arg == "-mpiio")
+      mode = util::PartitionedVolumeLoader::Mode::MPIIO;
+    else if (arg == "-strategy") {
+      if (i+1 >= argc)
+        usage(mpiRank);
+      const std::string s = argv[++i];
+      if (s == "kd")
+        strategy = util::Partitioner::Strategy::KD;
+      else if (s == "wkd")
+        strategy = util::Partitioner::Strategy::WeightedKD;
+      else if (s == "rr")
+        strategy = util::Partitioner::Strategy::RoundRobin;
+    }
+  }
+
+  // All ranks use the same transfer function, over the value
+  // range of the whole volume
+  std::vector<float3> colors = {
+    {0.f, 0.f, 1.f},
+    {0.f, 1.f, 0.f},
+    {1.f, 0.f, 0.f},
+  };
+  std::vector<float> opacities = {0.f, 1.f};
+
+  // Bricks the transfer function makes fully transparent aren't loaded
+  box3 bounds;
+  box1 valueRange;
+  util::PartitionedVolumeLoader loader(mode, strategy);
+  loader.transferFunction.opacity = opacities;
+  auto fields = loader.loadANARI(
+      device, fileName, mpiRank, mpiWorldSize, &bounds, &valueRange);
+
+  std::vector<anari::Volume> volumes;
+  for (auto field : fields) {
+    auto volume = anari::newObject<anari::Volume>(device, "transferFunction1D");
+    anari::setAndReleaseParameter(device, volume, "value", field);
+    anari::setParameterArray1D(device, volume, "color", colors.data(), colors.size());
+    anari::setParameterArray1D(device, volume, "opacity", opacities.data(), opacities.size());
+    anari::setParameter(device, volume, "valueRange", ANARI_FLOAT32_BOX1, &valueRange);
+    anari::commitParameters(device, volume);
+    volumes.push_back(volume);
+  }
+
+  auto world = anari::newObject<anari::World>(device);
+  auto vols = anari::newArray1D(device, volumes.data(), volumes.size());
+  anari::setAndReleaseParameter(device, world, "volume", vols);
+
+  // Specify the region of the world this rank owns
+  box3 regionBounds = loader.regionBounds(mpiRank);
+  if (regionBounds.lower.x <= regionBounds.upper.x) {
+    anari::setParameter(device, world, "region", ANARI_FLOAT32_BOX3, &regionBounds);
+  }
+
+  anari::commitParameters(device, world);
+
+  // image size
+  uint2 imgSize;
+  imgSize.x = 1024; // width
+  imgSize.y = 768; // height
+
+  // create and setup camera
+  util::Camera cam;
+  cam.perspective(
+      60.f*util::Camera::deg2rad, imgSize.x / (float)imgSize.y, 0.0001f, 10000.f);
+  cam.viewAll(bounds);
+
+  auto camera = anari::newObject<anari::Camera>(device, "perspective");
+  anari::setParameter(device, camera, "aspect", imgSize.x / (float)imgSize.y);
+  anari::setParameter(device, camera, "position", cam.getEye());
+  anari::setParameter(device, camera, "direction", cam.getCenter() - cam.getEye());
+  anari::setParameter(device, camera, "up", cam.getUp());
+  anari::commitParameters(device, camera); // commit each object to indicate modifications are done
+
+  // The ranks' regions in front-to-back order, as seen from the camera
+  if (mpiRank == 0 && loader.partitioner) {
+    loader.partitioner->printStats();
+    loader.partitioner->computeCompositeOrder(cam.getEye());
+    std::cout << "Composite order:";
+    for (auto rankID : loader.partitioner->compositeOrder)
+      std::cout << ' ' << rankID;
+    std::cout << '\n';
+  }
+
+  // create the default renderer
+  auto renderer = anari::newObject<anari::Renderer>(device, "default");
+  anari::commitParameters(device, renderer);
+
+  // create and setup frame
+  auto frame = anari::newObject<anari::Frame>(device);
+  anari::setParameter(device, frame, "size", imgSize);
+  anari::setParameter(device, frame, "channel.color", ANARI_UFIXED8_RGBA_SRGB);
+  anari::setParameter(device, frame, "world", world);
+  anari::setParameter(device, frame, "renderer", renderer);
+  anari::setParameter(device, frame, "camera", camera);
+  anari::commitParameters(device, frame);
+
+  // render one frame, and measure how long that takes across all ranks
+  MPI_Barrier(MPI_COMM_WORLD);
+  double start = MPI_Wtime();
+  anari::render(device, frame);
+  anari::wait(device, frame);
+  MPI_Barrier(MPI_COMM_WORLD);
+  double frameTime = MPI_Wtime()-start;
+
+  // on rank 0, access framebuffer and write its content as PNG file
+  if (mpiRank == 0) {
+    std::cout << "Frame time: " << frameTime*1000.0 << " ms\n";
+    auto fb = anari::map<uint32_t>(device, frame, "channel.color");
+    stbi_flip_vertically_on_write(1);
+    stbi_write_png(
+        "firstFrameVolume.png", imgSize.x, imgSize.y, 4, fb.data, 4 * fb.width);
+    anari::unmap(device, frame, "channel.color");
+  }
+
+  for (auto volume : volumes)
+    anari::release(device, volume);
+  anari::release(device, frame);
+  anari::release(device, renderer);
+  anari::release(device, camera);
+  anari::release(device, world);
+  anari::release(device, device);
+
+  anari::unloadLibrary(library);
+
+  MPI_Finalize();
+
+  return 0;
+}
@@ -0,0 +1,212 @@
+#pragma once
+
+// std
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+namespace util {
+
+  // ======================================================
+  // Lossless codecs for volume bricks; the codec is stored
+  // per brick, so bricks that don't compress are stored
+  // as-is
+  //
+  // LZ: the voxels' bytes are shuffled into byte planes
+  // (all first bytes, then all second bytes, ...), each
+  // plane is delta-encoded, and the result is compressed
+  // with a byte-oriented LZ77 variant (LZ4-like sequences
+  // of literals and back-references into a 64K window)
+  // ======================================================
+
+  enum class BrickCodec : uint32_t { None = 0, LZ = 1, };
+
+  namespace lz {
+
+    const size_t minMatch = 4;
+    const size_t maxOffset = 65535;
+    const int hashBits = 16;
+
+    inline uint32_t read32(const uint8_t *p)
+    {
+      uint32_t v;
+      memcpy(&v,p,sizeof(v));
+      return v;
+    }
+
+    inline uint32_t hash(uint32_t v)
+    { return (v*2654435761u) >> (32-hashBits); }
+
+    inline void writeLength(std::vector<uint8_t> &out, size_t len)
+    {
+      while (len >= 255) {
+        out.push_back(255);
+        len -= 255;
+      }
+      out.push_back((uint8_t)len);
+    }
+
+    inline bool readLength(const uint8_t *&ip, const uint8_t *end, size_t &len)
+    {
+      uint8_t b;
+      do {
+        if (ip >= end)
+          return false;
+        b = *ip++;
+        len += b;
+      } while (b == 255);
+      return true;
+    }
+
+    inline void emitSequence(std::vector<uint8_t> &out,
+                             const uint8_t *literals, size_t numLiterals,
+                             size_t offset, size_t matchLength)
+    {
+      size_t ml = matchLength ? matchLength-minMatch : 0;
+      uint8_t token = uint8_t((numLiterals < 15 ? numLiterals : 15) << 4)
+                    | uint8_t(ml < 15 ? ml : 15);
+      out.push_back(token);
+      if (numLiterals >= 15)
+        writeLength(out,numLiterals-15);
+      out.insert(out.end(),literals,literals+numLiterals);
+      if (matchLength) {
+        out.push_back(uint8_t(offset & 0xff));
+        out.push_back(uint8_t(offset >> 8));
+        if (ml >= 15)
+          writeLength(out,ml-15);
+      }
+    }
+
+    // The last sequence has literals only
+    inline void compress(const uint8_t *src, size_t n, std::vector<uint8_t> &out)
+    {
+      std::vector<uint32_t> table(size_t(1)<<hashBits,UINT32_MAX);
+
+      size_t anchor = 0, i = 0;
+      while (i+minMatch <= n) {
+        uint32_t h = hash(read32(src+i));
+        uint32_t candidate = table[h];
+        table[h] = (uint32_t)i;
+
+        if (candidate == UINT32_MAX || i-candidate > maxOffset
+         || read32(src+candidate) != read32(src+i)) {
+          ++i;
+          continue;
+        }
+
+        size_t len = minMatch;
+        while (i+len < n && src[candidate+len] == src[i+len])
+          ++len;
+
+        emitSequence(out,src+anchor,i-anchor,i-candidate,len);
+        i += len;
+        anchor = i;
+      }
+
+      emitSequence(out,src+anchor,n-anchor,0,0);
+    }
+
+    inline bool decompress(const uint8_t *src, size_t n, uint8_t *dst, size_t dstSize)
+    {
+      const uint8_t *ip = src, *end = src+n;
+      size_t op = 0;
+      while (ip < end) {
+        uint8_t token = *ip++;
+
+        size_t numLiterals = token >> 4;
+        if (numLiterals == 15 && !readLength(ip,end,numLiterals))
+          return false;
+        if (numLiterals > size_t(end-ip) || numLiterals > dstSize-op)
+          return false;
+        memcpy(dst+op,ip,numLiterals);
+        ip += numLiterals;
+        op += numLiterals;
+
+        if (ip == end)
+          break; // last sequence
+
+        if (end-ip < 2)
+          return false;
+        size_t offset = ip[0] | (size_t(ip[1]) << 8);
+        ip += 2;
+        size_t len = token & 15;
+        if (len == 15 && !readLength(ip,end,len))
+          return false;
+        len += minMatch;
+        if (offset == 0 || offset > op || len > dstSize-op)
+          return false;
+        // may overlap, copy bytewise
+        for (size_t j=0; j<len; ++j, ++op)
+          dst[op] = dst[op-offset];
+      }
+      return op == dstSize;
+    }
+
+  } // lz
+
+  // Encode numBytes bytes of voxels with bytesPerVoxel bytes each;
+  // returns false if the codec doesn't make the data smaller, in
+  // which case the brick should be stored with BrickCodec::None
+  inline bool encodeBrick(BrickCodec codec,
+                          int bytesPerVoxel,
+                          const void *src,
+                          size_t numBytes,
+                          std::vector<uint8_t> &out)
+  {
+    out.clear();
+    if (codec == BrickCodec::None)
+      return false;
+
+    const uint8_t *bytes = (const uint8_t *)src;
+    size_t numVoxels = numBytes/bytesPerVoxel;
+
+    std::vector<uint8_t> planes(numBytes);
+    for (int b=0; b<bytesPerVoxel; ++b) {
+      uint8_t *plane = planes.data()+b*numVoxels;
+      uint8_t prev = 0;
+      for (size_t i=0; i<numVoxels; ++i) {
+        uint8_t v = bytes[i*bytesPerVoxel+b];
+        plane[i] = uint8_t(v-prev);
+        prev = v;
+      }
+    }
+
+    lz::compress(planes.data(),planes.size(),out);
+    return out.size() < numBytes;
+  }
+
+  inline bool decodeBrick(BrickCodec codec,
+                          int bytesPerVoxel,
+                          const uint8_t *src,
+                          size_t storedBytes,
+                          void *dst,
+                          size_t numBytes)
+  {
+    if (codec == BrickCodec::None) {
+      if (storedBytes != numBytes)
+        return false;
+      memcpy(dst,src,numBytes);
+      return true;
+    }
+
+    if (codec != BrickCodec::LZ)
+      return false;
+
+    std::vector<uint8_t> planes(numBytes);
+    if (!lz::decompress(src,storedBytes,planes.data(),planes.size()))
+      return false;
+
+    uint8_t *bytes = (uint8_t *)dst;
+    size_t numVoxels = numBytes/bytesPerVoxel;
+    for (int b=0; b<bytesPerVoxel; ++b) {
+      const uint8_t *plane = planes.data()+b*numVoxels;
+      uint8_t prev = 0;
+      for (size_t i=0; i<numVoxels; ++i) {
+        prev = uint8_t(prev+plane[i]);
+        bytes[i*bytesPerVoxel+b] = prev;
+      }
+    }
+    return true;
+  }
+
+} // util
@@ -0,0 +1,163 @@
+#include <cstring>
+#include <stdexcept>
+#include "CommandChannel.h"
+
+namespace util {
+
+  // Packet: uint32 payloadBytes (broadcast first, fixed size), then
+  // the payload (broadcast second, payloadBytes long), made of runs of
+  //   uint16 offset, uint16 length, uint8 bytes[length]
+  // Runs separated by fewer than minGap equal bytes are merged
+  static const size_t headerSize = sizeof(uint32_t);
+  static const size_t runHeaderSize = 2*sizeof(uint16_t);
+  static const size_t minGap = runHeaderSize;
+  static const unsigned numSendSlots = 8;
+
+  CommandChannel::CommandChannel(size_t stateSize, MPI_Comm parent)
+    : stateSize(stateSize)
+  {
+    if (stateSize == 0 || stateSize > UINT16_MAX) {
+      throw std::runtime_error("CommandChannel: unsupported state size");
+    }
+
+    MPI_Comm_dup(parent, &comm);
+    MPI_Comm_rank(comm, &rank);
+
+    // worst case is a single run covering the whole state
+    maxPayloadSize = runHeaderSize+stateSize;
+    base.resize(stateSize, 0);
+    slots.resize(rank == 0 ? numSendSlots : 1);
+    for (auto &slot : slots) {
+      slot.payload.resize(maxPayloadSize);
+    }
+  }
+
+  CommandChannel::~CommandChannel() {
+    // e.g., owned by an object that outlives MPI_Finalize()
+    int finalized = 0;
+    MPI_Finalized(&finalized);
+    if (finalized) {
+      return;
+    }
+
+    // Rank 0's packets complete once the other ranks received them;
+    // a receive posted by poll() can't be cancelled
+    if (rank == 0) {
+      for (auto &slot : slots) {
+        MPI_Waitall(2, slot.requests, MPI_STATUSES_IGNORE);
+      }
+    }
+    MPI_Comm_free(&comm);
+  }
+
+  void CommandChannel::send(const void *state) {
+    // retire completed packets, so MPI can make progress
+    for (auto &slot : slots) {
+      int done = 0;
+      MPI_Testall(2, slot.requests, &done, MPI_STATUSES_IGNORE);
+    }
+
+    Slot &slot = slots[nextSlot];
+    nextSlot = (nextSlot+1) % slots.size();
+    MPI_Waitall(2, slot.requests, MPI_STATUSES_IGNORE);
+
+    slot.payloadBytes = (uint32_t)encode((const uint8_t *)state, slot.payload.data());
+    memcpy(base.data(), state, stateSize);
+    lastPacketBytes = headerSize+slot.payloadBytes;
+
+    MPI_Ibcast(&slot.payloadBytes, 1, MPI_UINT32_T, 0, comm, &slot.requests[0]);
+    MPI_Ibcast(slot.payload.data(), (int)slot.payloadBytes, MPI_BYTE, 0, comm,
+               &slot.requests[1]);
+  }
+
+  // The payload's size is only known once the header arrived, so the
+  // two broadcasts are posted one after the other
+  bool CommandChannel::poll(void *state) {
+    Slot &slot = slots[0];
+    if (stage == Stage::Idle) {
+      MPI_Ibcast(&slot.payloadBytes, 1, MPI_UINT32_T, 0, comm, &slot.requests[0]);
+      stage = Stage::Header;
+    }
+
+    int done = 0;
+    if (stage == Stage::Header) {
+      MPI_Test(&slot.requests[0], &done, MPI_STATUS_IGNORE);
+      if (!done) {
+        return false;
+      }
+      MPI_Ibcast(slot.payload.data(), (int)slot.payloadBytes, MPI_BYTE, 0, comm,
+                 &slot.requests[1]);
+      stage = Stage::Payload;
+    }
+
+    MPI_Test(&slot.requests[1], &done, MPI_STATUS_IGNORE);
+    if (!done) {
+      return false;
+    }
+
+    stage = Stage::Idle;
+    decode(slot.payload.data(), slot.payloadBytes, state);
+    return true;
+  }
+
+  void CommandChannel::receive(void *state) {
+    while (!poll(state)) {
+      Slot &slot = slots[0];
+      MPI_Wait(&slot.requests[stage == Stage::Header ? 0 : 1], MPI_STATUS_IGNORE);
+    }
+  }
+
+  size_t CommandChannel::encode(const uint8_t *state, uint8_t *payload) {
+    uint8_t *out = payload;
+    size_t i = 0;
+    while (i < stateSize) {
+      if (state[i] == base[i]) {
+        ++i;
+        continue;
+      }
+
+      // extend the run until minGap equal bytes in a row
+      size_t first = i, last = i+1, gap = 0;
+      for (size_t j=i+1; j<stateSize && gap<minGap; ++j) {
+        if (state[j] == base[j]) {
+          ++gap;
+        } else {
+          gap = 0;
+          last = j+1;
+        }
+      }
+
+      // many short runs can be larger than the whole state
+      if (size_t(out-payload)+runHeaderSize+(last-first) > maxPayloadSize) {
+        out = payload;
+        first = 0;
+        last = stateSize;
+      }
+
+      uint16_t offset = (uint16_t)first, length = (uint16_t)(last-first);
+      memcpy(out, &offset, sizeof(offset));
+      memcpy(out+sizeof(offset), &length, sizeof(length));
+      memcpy(out+runHeaderSize, state+first, length);
+      out += runHeaderSize+length;
+      i = last;
+    }
+
+    return out-payload;
+  }
+
+  void CommandChannel::decode(const uint8_t *payload, size_t payloadBytes, void *state) {
+    const uint8_t *in = payload;
+    const uint8_t *end = in+payloadBytes;
+    while (in < end) {
+      uint16_t offset, length;
+      memcpy(&offset, in, sizeof(offset));
+      memcpy(&length, in+sizeof(offset), sizeof(length));
+      memcpy(base.data()+offset, in+runHeaderSize, length);
+      in += runHeaderSize+length;
+    }
+
+    lastPacketBytes = headerSize+payloadBytes;
+    memcpy(state, base.data(), stateSize);
+  }
+
+} // ::util
@@ -0,0 +1,69 @@
+#pragma once
+
+// std
+#include <cstdint>
+#include <vector>
+// mpi
+#include <mpi.h>
+
+namespace util {
+
+  // ======================================================
+  // Non-blocking broadcast of a fixed-size, trivially
+  // copyable state from rank 0 to the other ranks. Packets
+  // are sent with MPI_Ibcast on a duplicate of the
+  // communicator: a fixed-size header with the payload's
+  // size, then the payload, which only contains the byte
+  // runs that changed since the previous packet. Rank 0
+  // never waits for the other ranks (unless all its packet
+  // slots are in flight); those receive when they need the
+  // next state
+  // ======================================================
+  class CommandChannel {
+  public:
+    CommandChannel(size_t stateSize, MPI_Comm comm = MPI_COMM_WORLD);
+    ~CommandChannel();
+
+    CommandChannel(const CommandChannel &) = delete;
+    CommandChannel& operator=(const CommandChannel &) = delete;
+
+    // Rank 0: broadcast the state (stateSize bytes)
+    void send(const void *state);
+
+    // Other ranks: receive the next state into 'state'; poll()
+    // returns false if it hasn't arrived yet. Each send() has
+    // to be matched by exactly one receive or successful poll
+    bool poll(void *state);
+    void receive(void *state);
+
+    // Bytes of the last packet sent or received (incl. header)
+    size_t lastPacketSize() const { return lastPacketBytes; }
+
+  private:
+    struct Slot {
+      uint32_t payloadBytes = 0;
+      std::vector<uint8_t> payload;
+      // header, payload
+      MPI_Request requests[2] = {MPI_REQUEST_NULL, MPI_REQUEST_NULL};
+    };
+
+    // other ranks: which broadcast of the next packet is posted
+    enum class Stage { Idle, Header, Payload, };
+
+    size_t encode(const uint8_t *state, uint8_t *payload);
+    void decode(const uint8_t *payload, size_t payloadBytes, void *state);
+
+    MPI_Comm comm;
+    int rank = -1;
+    size_t stateSize;
+    size_t maxPayloadSize;
+    // the previous packet's state, delta base on all ranks
+    std::vector<uint8_t> base;
+    // rank 0: packets in flight; other ranks: slots[0] only
+    std::vector<Slot> slots;
+    unsigned nextSlot = 0;
+    Stage stage = Stage::Idle;
+    size_t lastPacketBytes = 0;
+  };
+
+} // ::util
@@ -66,7 +66,9 @@ namespace util {
     num_bytes = stat_buf.st_size;
 
     mapping = mmap(NULL, num_bytes, PROT_READ, MAP_SHARED, file, 0);
-    if (!mapping) {
+    if (mapping == MAP_FAILED) {
+    	mapping = nullptr;
+    	close(file);
     	throw std::runtime_error("Failed to map file!");
     }
 #endif
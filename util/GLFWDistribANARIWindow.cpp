@@ -2,6 +2,9 @@
 #include "GLFWDistribANARIWindow.h"
 #include <imgui.h>
 #include <mpi.h>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
 #include <iomanip>
 #include <iostream>
 #include <sstream>
@@ -12,33 +15,102 @@ using namespace anari;
 using namespace util;
 using namespace anari::math;
 
-template <typename R, typename TASK_T>
-static std::future<R> async(TASK_T &&fcn)
-{
-  auto task = std::packaged_task<R()>(std::forward<TASK_T>(fcn));
-  auto future = task.get_future();
-
-  std::thread([task = std::move(task)]() mutable { task(); }).detach();
+GLFWDistribANARIWindow *GLFWDistribANARIWindow::activeWindow = nullptr;
 
-  return future;
-}
+static bool g_quitNextFrame = false;
 
-template <typename R>
-static bool is_ready(const std::future<R> &f)
+// Pixel buffer objects (OpenGL 2.1) aren't in every platform's GL
+// headers, so their entry points are loaded at runtime
+#ifndef GL_PIXEL_UNPACK_BUFFER
+#define GL_PIXEL_UNPACK_BUFFER 0x88EC
+#endif
+#ifndef GL_STREAM_DRAW
+#define GL_STREAM_DRAW 0x88E0
+#endif
+#ifndef GL_WRITE_ONLY
+#define GL_WRITE_ONLY 0x88B9
+#endif
+// same for fences and mapping buffer ranges (OpenGL 3.2)
+#ifndef GL_MAP_WRITE_BIT
+#define GL_MAP_WRITE_BIT 0x0002
+#endif
+#ifndef GL_MAP_UNSYNCHRONIZED_BIT
+#define GL_MAP_UNSYNCHRONIZED_BIT 0x0020
+#endif
+#ifndef GL_SYNC_GPU_COMMANDS_COMPLETE
+#define GL_SYNC_GPU_COMMANDS_COMPLETE 0x9117
+#endif
+#ifndef GL_SYNC_FLUSH_COMMANDS_BIT
+#define GL_SYNC_FLUSH_COMMANDS_BIT 0x00000001
+#endif
+#ifndef GL_TIMEOUT_EXPIRED
+#define GL_TIMEOUT_EXPIRED 0x911B
+#endif
+#ifdef _WIN32
+#define PBO_APIENTRY __stdcall
+#else
+#define PBO_APIENTRY
+#endif
+
+static struct
 {
-  return !f.valid()
-      || f.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
-}
+  void(PBO_APIENTRY *genBuffers)(GLsizei, GLuint *) = nullptr;
+  void(PBO_APIENTRY *deleteBuffers)(GLsizei, const GLuint *) = nullptr;
+  void(PBO_APIENTRY *bindBuffer)(GLenum, GLuint) = nullptr;
+  void(PBO_APIENTRY *bufferData)(GLenum, ptrdiff_t, const void *, GLenum) = nullptr;
+  void *(PBO_APIENTRY *mapBuffer)(GLenum, GLenum) = nullptr;
+  GLboolean(PBO_APIENTRY *unmapBuffer)(GLenum) = nullptr;
+  // optional; the sync objects are GLsync handles
+  void *(PBO_APIENTRY *mapBufferRange)(
+      GLenum, ptrdiff_t, ptrdiff_t, GLbitfield) = nullptr;
+  void *(PBO_APIENTRY *fenceSync)(GLenum, GLbitfield) = nullptr;
+  GLenum(PBO_APIENTRY *clientWaitSync)(void *, GLbitfield, uint64_t) = nullptr;
+  void(PBO_APIENTRY *deleteSync)(void *) = nullptr;
+
+  template <typename F>
+  static void load(F &func, const char *name)
+  {
+    func = (F)glfwGetProcAddress(name);
+  }
 
-GLFWDistribANARIWindow *GLFWDistribANARIWindow::activeWindow = nullptr;
+  // needs a current context
+  bool load()
+  {
+    load(genBuffers, "glGenBuffers");
+    load(deleteBuffers, "glDeleteBuffers");
+    load(bindBuffer, "glBindBuffer");
+    load(bufferData, "glBufferData");
+    load(mapBuffer, "glMapBuffer");
+    load(unmapBuffer, "glUnmapBuffer");
+    return genBuffers && deleteBuffers && bindBuffer && bufferData
+        && mapBuffer && unmapBuffer;
+  }
 
-static bool g_quitNextFrame = false;
+  // some platforms return entry points for anything, so check the
+  // extensions first
+  bool loadSync()
+  {
+    if (!glfwExtensionSupported("GL_ARB_sync")
+        || !glfwExtensionSupported("GL_ARB_map_buffer_range")) {
+      return false;
+    }
+    load(mapBufferRange, "glMapBufferRange");
+    load(fenceSync, "glFenceSync");
+    load(clientWaitSync, "glClientWaitSync");
+    load(deleteSync, "glDeleteSync");
+    return mapBufferRange && fenceSync && clientWaitSync && deleteSync;
+  }
+} g_pbo;
 
 WindowState::WindowState()
     : quit(false),
       cameraChanged(false),
       fbSizeChanged(false),
+      rebalance(false),
+      nextFrame(true),
+      render(true),
       spp(1),
+      renderScale(1.f),
       windowSize(0),
       eyePos(0.f),
       lookDir(0.f),
@@ -59,6 +131,9 @@ GLFWDistribANARIWindow::GLFWDistribANARIWindow(const int2 &windowSize,
   MPI_Comm_rank(MPI_COMM_WORLD, &mpiRank);
   MPI_Comm_size(MPI_COMM_WORLD, &mpiWorldSize);
 
+  commandChannel = std::unique_ptr<CommandChannel>(
+      new CommandChannel(sizeof(WindowState), MPI_COMM_WORLD));
+
   if (mpiRank == 0) {
     if (activeWindow != nullptr) {
       throw std::runtime_error(
@@ -97,6 +172,15 @@ GLFWDistribANARIWindow::GLFWDistribANARIWindow(const int2 &windowSize,
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
 
+    // pixel buffer objects to upload the frames from: a ring if fences
+    // are supported, otherwise a single one, see beginUpload()
+    if (g_pbo.load()) {
+      pixelBuffers.resize(g_pbo.loadSync() ? numPixelBuffers : 1);
+      for (auto &pb : pixelBuffers) {
+        g_pbo.genBuffers(1, &pb.buffer);
+      }
+    }
+
     // set GLFW callbacks
     glfwSetFramebufferSizeCallback(
         glfwWindow, [](GLFWwindow *, int newWidth, int newHeight) {
@@ -157,7 +241,30 @@ GLFWDistribANARIWindow::GLFWDistribANARIWindow(const int2 &windowSize,
 
 GLFWDistribANARIWindow::~GLFWDistribANARIWindow()
 {
+  if (frameInFlight) {
+    anari::wait(device, frames[renderIndex]);
+  }
+  for (auto f : frames) {
+    if (f)
+      anari::release(device, f);
+  }
+  anari::release(device, camera);
+
+  int finalized = 0;
+  MPI_Finalized(&finalized);
+  if (rebalanceComm != MPI_COMM_NULL && !finalized) {
+    MPI_Comm_free(&rebalanceComm);
+  }
+
   if (mpiRank == 0) {
+    for (auto &pb : pixelBuffers) {
+      if (pb.uploaded) {
+        g_pbo.deleteSync(pb.uploaded);
+      }
+      g_pbo.deleteBuffers(1, &pb.buffer);
+    }
+    glDeleteTextures(1, &framebufferTexture);
+
     ImGui_ImplGlfwGL3_Shutdown();
     // cleanly terminate GLFW
     glfwTerminate();
@@ -182,6 +289,51 @@ void GLFWDistribANARIWindow::setWorld(anari::World newWorld)
 
 void GLFWDistribANARIWindow::resetAccumulation()
 {
+  for (int i = 0; i < 2; ++i) {
+    frameRenders[i] = 0;
+    frameSamples[i] = 0;
+  }
+  accumulationEpoch++;
+  latestVariance = -1.f;
+}
+
+void GLFWDistribANARIWindow::setAccumulationTarget(
+    int spp, float varianceThreshold)
+{
+  accumulationTargetSpp = spp;
+  this->varianceThreshold = varianceThreshold;
+}
+
+void GLFWDistribANARIWindow::setTargetFrameTime(
+    float targetFrameTime, float minScale)
+{
+  this->targetFrameTime = targetFrameTime;
+  minRenderScale = std::min(std::max(minScale, 0.01f), 1.f);
+}
+
+int GLFWDistribANARIWindow::getAccumulatedFrames() const
+{
+  return frameRenders[1 - renderIndex];
+}
+
+int GLFWDistribANARIWindow::getAccumulatedSamples() const
+{
+  return frameSamples[1 - renderIndex];
+}
+
+float GLFWDistribANARIWindow::getVarianceEstimate() const
+{
+  return latestVariance;
+}
+
+void GLFWDistribANARIWindow::setPixelSamples(int spp)
+{
+  windowState.spp = spp;
+}
+
+int GLFWDistribANARIWindow::getPixelSamples() const
+{
+  return frameState.spp;
 }
 
 void GLFWDistribANARIWindow::registerDisplayCallback(
@@ -196,22 +348,71 @@ void GLFWDistribANARIWindow::registerImGuiCallback(
   uiCallback = callback;
 }
 
+void GLFWDistribANARIWindow::registerRebalanceCallback(
+    std::function<void(const std::vector<float> &)> callback,
+    float threshold,
+    int numFrames)
+{
+  rebalanceCallback = callback;
+  rebalanceThreshold = threshold;
+  rebalanceNumFrames = numFrames;
+  accumulatedRenderTime = 0.0;
+  numMeasuredFrames = 0;
+  if (rebalanceComm == MPI_COMM_NULL) {
+    MPI_Comm_dup(MPI_COMM_WORLD, &rebalanceComm);
+  }
+}
+
 void GLFWDistribANARIWindow::mainLoop()
 {
   while (true) {
-    MPI_Bcast(&windowState, sizeof(WindowState), MPI_BYTE, 0, MPI_COMM_WORLD);
-    if (windowState.quit) {
+    // Rank 0 sends its window state only when a frame starts (or to
+    // quit), without waiting for the other ranks. Those block until
+    // the next frame's state arrives: rendering is collective, so they
+    // can't accumulate samples on their own
+    bool haveState = true;
+    if (mpiRank == 0) {
+      haveState = windowState.nextFrame || windowState.quit;
+      if (haveState) {
+        windowState.renderScale = adaptiveRenderScale();
+        frameState = windowState;
+        windowState.cameraChanged = false;
+        windowState.fbSizeChanged = false;
+        windowState.rebalance = false;
+        commandChannel->send(&frameState);
+      }
+    } else {
+      commandChannel->receive(&frameState);
+    }
+
+    if (haveState && frameState.quit) {
       break;
     }
 
-    // TODO: Actually render asynchronously, if we have MPI thread multiple
-    // support
-    startNewANARIFrame();
-    waitOnANARIFrame();
+    // Frames are pipelined: once rank 0's frame is done, all ranks
+    // start rendering the next one, while rank 0 keeps polling events
+    // and displays the finished frame
+    if (haveState && frameState.nextFrame) {
+      waitOnANARIFrame();
+    }
+
+    if (haveState && frameState.nextFrame && frameState.render) {
+      // Runs while no frame is in flight (every rebalanceNumFrames
+      // frames, the same ones on all ranks)
+      if (rebalanceCallback && numMeasuredFrames >= rebalanceNumFrames) {
+        gatherRenderTimes();
+      }
+
+      if (frameState.rebalance) {
+        rebalance();
+      }
+
+      // if a display callback has been registered, call it
+      if (displayCallback) {
+        displayCallback(this);
+      }
 
-    // if a display callback has been registered, call it
-    if (displayCallback) {
-      displayCallback(this);
+      startNewANARIFrame();
     }
 
     if (mpiRank == 0) {
@@ -219,9 +420,21 @@ void GLFWDistribANARIWindow::mainLoop()
 
       display();
 
-      // poll and process events
-      glfwPollEvents();
+      // poll and process events; once converged, there's nothing to do
+      // until the next event
+      bool converged = accumulationConverged();
+      if (converged && !frameInFlight && !newFrameToDisplay) {
+        glfwWaitEventsTimeout(0.1);
+      } else {
+        glfwPollEvents();
+      }
       windowState.quit = glfwWindowShouldClose(glfwWindow) || g_quitNextFrame;
+
+      // Once converged, the in-flight frame is still finished
+      converged = accumulationConverged();
+      windowState.render = !converged;
+      windowState.nextFrame =
+          isANARIFrameReady() && (frameInFlight || !converged);
     }
   }
 }
@@ -248,6 +461,7 @@ void GLFWDistribANARIWindow::motion(const int2 &position)
   arcballCamera->handleMouseEvent(position.x, position.y, glfwWindow);
 
   if (arcballCamera->hasCameraChanged()) {
+    lastCameraChange = std::chrono::high_resolution_clock::now();
     windowState.cameraChanged = true;
     windowState.eyePos = arcballCamera->getEye();
     windowState.lookDir = arcballCamera->getCenter() - arcballCamera->getEye();
@@ -260,6 +474,28 @@ void GLFWDistribANARIWindow::display()
   // clock used to compute frame rate
   static auto displayStart = std::chrono::high_resolution_clock::now();
 
+  // Start uploading a new frame first: its pixels are copied into a
+  // pixel buffer on another thread while the UI is built and the
+  // variance is estimated
+  anari::Frame displayFrame = nullptr;
+  anari::MappedFrameData<uint32_t> fb{};
+  if (newFrameToDisplay) {
+    // display frame rate in window title
+    auto displayEnd = std::chrono::high_resolution_clock::now();
+    auto durationMilliseconds =
+        std::chrono::duration_cast<std::chrono::milliseconds>(
+            displayEnd - displayStart);
+
+    latestFPS = 1000.f / float(durationMilliseconds.count());
+
+    // map ANARI frame buffer and update the OpenGL texture with its
+    // contents; the other frame is rendering meanwhile
+    displayFrame = frames[1 - renderIndex];
+    fb = anari::map<uint32_t>(device, displayFrame, "channel.color");
+
+    beginUpload(fb.data, fb.width, fb.height);
+  }
+
   if (showUi && uiCallback) {
     ImGuiWindowFlags flags = ImGuiWindowFlags_AlwaysAutoResize;
     ImGui::Begin(
@@ -272,69 +508,168 @@ void GLFWDistribANARIWindow::display()
   // updateTitleBar();
 
 
-  static bool firstFrame = true;
-  if (firstFrame || is_ready(currentFrame)) {
-    // display frame rate in window title
-    auto displayEnd = std::chrono::high_resolution_clock::now();
-    auto durationMilliseconds =
-        std::chrono::duration_cast<std::chrono::milliseconds>(
-            displayEnd - displayStart);
-
-    latestFPS = 1000.f / float(durationMilliseconds.count());
-
-    // map ANARI frame buffer, update OpenGL texture with its contents, then
-    // unmap
-
-    auto fb = anari::map<uint32_t>(device, frame, "channel.color");
-
-    glBindTexture(GL_TEXTURE_2D, framebufferTexture);
-    glTexImage2D(GL_TEXTURE_2D,
-        0,
-        GL_RGBA,
-        windowSize.x,
-        windowSize.y,
-        0,
-        GL_RGBA,
-        GL_UNSIGNED_BYTE,
-        fb.data);
+  if (displayFrame) {
+    if (varianceThreshold > 0.f) {
+      estimateVariance(fb.data, fb.width, fb.height, 1 - renderIndex);
+    }
 
-    anari::unmap(device, frame, "channel.color");
+    finishUpload();
+    anari::unmap(device, displayFrame, "channel.color");
 
-    // Start new frame and reset frame timing interval start
+    // Reset frame timing interval start
     displayStart = std::chrono::high_resolution_clock::now();
-    firstFrame = false;
+    newFrameToDisplay = false;
   }
 
   // clear current OpenGL color buffer
   glClear(GL_COLOR_BUFFER_BIT);
 
   // render textured quad with OSPRay frame buffer contents
-  glBegin(GL_QUADS);
+  static const GLfloat texCoords[] = {0.f, 0.f, 0.f, 1.f, 1.f, 1.f, 1.f, 0.f};
+  const GLfloat vertices[] = {0.f,
+      0.f,
+      0.f,
+      GLfloat(windowSize.y),
+      GLfloat(windowSize.x),
+      GLfloat(windowSize.y),
+      GLfloat(windowSize.x),
+      0.f};
+
+  glBindTexture(GL_TEXTURE_2D, framebufferTexture);
+  glEnableClientState(GL_VERTEX_ARRAY);
+  glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+  glVertexPointer(2, GL_FLOAT, 0, vertices);
+  glTexCoordPointer(2, GL_FLOAT, 0, texCoords);
+  glDrawArrays(GL_TRIANGLE_FAN, 0, 4);
+  glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+  glDisableClientState(GL_VERTEX_ARRAY);
+
+  ImGui::Render();
+  ImGui_ImplGlfwGL3_Render();
 
-  glTexCoord2f(0.f, 0.f);
-  glVertex2f(0.f, 0.f);
+  // swap buffers
+  glfwSwapBuffers(glfwWindow);
+}
 
-  glTexCoord2f(0.f, 1.f);
-  glVertex2f(0.f, windowSize.y);
+// The texture storage is only reallocated when the frame size changes.
+// The pixels are copied into a pixel buffer object and the texture is
+// updated from there, so glTexSubImage2D returns right away and the
+// transfer to the GPU overlaps with rendering. The copy runs on another
+// thread until finishUpload().
+//
+// With fences, the buffers form a ring whose storage is kept: a buffer
+// is only reused once the upload from it has completed (numPixelBuffers
+// frames ago, so normally without waiting), and is mapped without
+// synchronizing. Otherwise, the single buffer is orphaned every frame.
+void GLFWDistribANARIWindow::beginUpload(
+    const uint32_t *pixels, int width, int height)
+{
+  glBindTexture(GL_TEXTURE_2D, framebufferTexture);
+
+  if (textureSize != int2(width, height)) {
+    glTexImage2D(GL_TEXTURE_2D,
+        0,
+        GL_RGBA8,
+        width,
+        height,
+        0,
+        GL_RGBA,
+        GL_UNSIGNED_BYTE,
+        nullptr);
+    textureSize = int2(width, height);
+  }
 
-  glTexCoord2f(1.f, 1.f);
-  glVertex2f(windowSize.x, windowSize.y);
+  uploadPixels = pixels;
+  if (pixelBuffers.empty()) {
+    return;
+  }
 
-  glTexCoord2f(1.f, 0.f);
-  glVertex2f(windowSize.x, 0.f);
+  PixelBuffer &pb = pixelBuffers[nextPixelBuffer];
+  nextPixelBuffer = (nextPixelBuffer + 1) % pixelBuffers.size();
+  g_pbo.bindBuffer(GL_PIXEL_UNPACK_BUFFER, pb.buffer);
+
+  size_t numBytes = size_t(width) * height * sizeof(uint32_t);
+  void *mapped = nullptr;
+  if (pixelBuffers.size() > 1) {
+    if (pb.uploaded) {
+      while (g_pbo.clientWaitSync(
+                 pb.uploaded, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000)
+          == GL_TIMEOUT_EXPIRED)
+        ;
+      g_pbo.deleteSync(pb.uploaded);
+      pb.uploaded = nullptr;
+    }
+    if (pb.numBytes != numBytes) {
+      g_pbo.bufferData(
+          GL_PIXEL_UNPACK_BUFFER, ptrdiff_t(numBytes), nullptr, GL_STREAM_DRAW);
+      pb.numBytes = numBytes;
+    }
+    mapped = g_pbo.mapBufferRange(GL_PIXEL_UNPACK_BUFFER,
+        0,
+        ptrdiff_t(numBytes),
+        GL_MAP_WRITE_BIT | GL_MAP_UNSYNCHRONIZED_BIT);
+  } else {
+    g_pbo.bufferData(
+        GL_PIXEL_UNPACK_BUFFER, ptrdiff_t(numBytes), nullptr, GL_STREAM_DRAW);
+    mapped = g_pbo.mapBuffer(GL_PIXEL_UNPACK_BUFFER, GL_WRITE_ONLY);
+  }
 
-  glEnd();
+  // stays mapped, but unbound, until finishUpload()
+  g_pbo.bindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
 
-  ImGui::Render();
-  ImGui_ImplGlfwGL3_Render();
+  if (mapped) {
+    uploadBuffer = &pb;
+    pendingCopy = std::async(std::launch::async,
+        [=]() { memcpy(mapped, pixels, numBytes); });
+  }
+}
 
-  // swap buffers
-  glfwSwapBuffers(glfwWindow);
+void GLFWDistribANARIWindow::finishUpload()
+{
+  glBindTexture(GL_TEXTURE_2D, framebufferTexture);
+
+  bool uploaded = false;
+  if (uploadBuffer) {
+    pendingCopy.get();
+    g_pbo.bindBuffer(GL_PIXEL_UNPACK_BUFFER, uploadBuffer->buffer);
+    // the contents are lost if unmapping fails, upload directly then
+    if (g_pbo.unmapBuffer(GL_PIXEL_UNPACK_BUFFER)) {
+      glTexSubImage2D(GL_TEXTURE_2D,
+          0,
+          0,
+          0,
+          textureSize.x,
+          textureSize.y,
+          GL_RGBA,
+          GL_UNSIGNED_BYTE,
+          nullptr); // offset into the pixel buffer
+      if (pixelBuffers.size() > 1) {
+        uploadBuffer->uploaded =
+            g_pbo.fenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+      }
+      uploaded = true;
+    }
+    g_pbo.bindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    uploadBuffer = nullptr;
+  }
+
+  if (!uploaded) {
+    glTexSubImage2D(GL_TEXTURE_2D,
+        0,
+        0,
+        0,
+        textureSize.x,
+        textureSize.y,
+        GL_RGBA,
+        GL_UNSIGNED_BYTE,
+        uploadPixels);
+  }
+  uploadPixels = nullptr;
 }
 
+// Called with no frame in flight, so objects can be committed safely
 void GLFWDistribANARIWindow::startNewANARIFrame()
 {
-  //currentFrame = async<void>([&, this]() {
     bool fbNeedsClear = false;
     auto handles = objectsToCommit.consume();
     if (!handles.empty()) {
@@ -344,46 +679,239 @@ void GLFWDistribANARIWindow::startNewANARIFrame()
       fbNeedsClear = true;
     }
 
-    if (windowState.fbSizeChanged) {
-      windowState.fbSizeChanged = false;
-      windowSize = windowState.windowSize;
+    if (frameState.fbSizeChanged) {
+      windowSize = frameState.windowSize;
 
-      frame = anari::newObject<anari::Frame>(device);
-      anari::setParameter(device, frame, "size", (uint2)windowSize);
-      anari::setParameter(device, frame, "channel.color", ANARI_UFIXED8_RGBA_SRGB);
-      anari::setParameter(device, frame, "world", world);
-      anari::setParameter(device, frame, "renderer", renderer);
-      anari::setParameter(device, frame, "camera", camera);
-      anari::commitParameters(device, frame);
+      createFrames();
 
       anari::setParameter(device, camera, "aspect", windowSize.x / float(windowSize.y));
       anari::commitParameters(device, camera);
 
       fbNeedsClear = true;
     }
-    if (windowState.cameraChanged) {
-      windowState.cameraChanged = false;
+    if (frameState.cameraChanged) {
       anari::setParameter(device, camera, "aspect", windowSize.x / float(windowSize.y));
-      anari::setParameter(device, camera, "position", windowState.eyePos);
-      anari::setParameter(device, camera, "direction", windowState.lookDir);
-      anari::setParameter(device, camera, "up", windowState.upDir);
+      anari::setParameter(device, camera, "position", frameState.eyePos);
+      anari::setParameter(device, camera, "direction", frameState.lookDir);
+      anari::setParameter(device, camera, "up", frameState.upDir);
       anari::commitParameters(device, camera);
       fbNeedsClear = true;
     }
 
+    // Resize the frame to render, if the render scale changed
+    uint2 frameSize(std::max(1, int(windowSize.x * frameState.renderScale + 0.5f)),
+        std::max(1, int(windowSize.y * frameState.renderScale + 0.5f)));
+    if (frameSizes[renderIndex] != frameSize) {
+      anari::setParameter(device, frames[renderIndex], "size", frameSize);
+      anari::commitParameters(device, frames[renderIndex]);
+      frameSizes[renderIndex] = frameSize;
+      fbNeedsClear = true;
+    }
+    frameScales[renderIndex] = frameState.renderScale;
+
     if (fbNeedsClear) {
       resetAccumulation();
     }
 
-    anari::render(device, frame);
-  //});
+    renderStart = std::chrono::high_resolution_clock::now();
+    anari::render(device, frames[renderIndex]);
+    frameInFlight = true;
+
+    // the frames accumulate separately, every other render
+    frameEpoch[renderIndex] = accumulationEpoch;
+    frameRenders[renderIndex]++;
+    frameSamples[renderIndex] += std::max(1, frameState.spp);
 }
 
+// Finish the in-flight frame (on rank 0 it's already done when this
+// is called) and make it the one to display
 void GLFWDistribANARIWindow::waitOnANARIFrame()
 {
-  // if (currentFrame.valid()) {
-  //   currentFrame.get();
-  // }
+  if (!frameInFlight) {
+    return;
+  }
+
+  anari::wait(device, frames[renderIndex]);
+  frameInFlight = false;
+
+  // Prefer the device's measurement, the wait may have started late
+  float duration = 0.f;
+  if (anari::getProperty(device, frames[renderIndex], "duration", duration, ANARI_NO_WAIT)
+      && duration > 0.f) {
+    latestRenderTime = duration;
+  } else {
+    auto renderEnd = std::chrono::high_resolution_clock::now();
+    latestRenderTime =
+        std::chrono::duration<float>(renderEnd - renderStart).count();
+  }
+
+  finishedFrameScale = frameScales[renderIndex];
+
+  if (rebalanceCallback) {
+    accumulatedRenderTime += latestRenderTime;
+    numMeasuredFrames++;
+  }
+  renderIndex = 1 - renderIndex;
+  newFrameToDisplay = true;
+}
+
+bool GLFWDistribANARIWindow::isANARIFrameReady()
+{
+  return !frameInFlight || anari::isReady(device, frames[renderIndex]);
+}
+
+// Rank 0: nothing changed since the last frame and the accumulation
+// target was reached
+bool GLFWDistribANARIWindow::accumulationConverged() const
+{
+  if (windowState.cameraChanged || windowState.fbSizeChanged
+      || windowState.rebalance || windowState.spp != frameState.spp
+      || adaptiveRenderScale() != frameState.renderScale
+      || !objectsToCommit.empty()) {
+    return false;
+  }
+
+  // Decided from the finished (displayed) frame
+  int finished = 1 - renderIndex;
+  if (frameEpoch[finished] != accumulationEpoch) {
+    return false;
+  }
+
+  if (accumulationTargetSpp > 0 && frameSamples[finished] >= accumulationTargetSpp) {
+    return true;
+  }
+
+  return varianceThreshold > 0.f && latestVariance >= 0.f
+      && latestVariance <= varianceThreshold;
+}
+
+// Rank 0: full resolution once the camera has settled; while it moves,
+// the frame time is about proportional to the number of pixels, so
+// scale both sides by sqrt(target/measured)
+float GLFWDistribANARIWindow::adaptiveRenderScale() const
+{
+  const float settleTime = 0.2f;
+
+  if (targetFrameTime <= 0.f) {
+    return 1.f;
+  }
+
+  auto now = std::chrono::high_resolution_clock::now();
+  if (std::chrono::duration<float>(now - lastCameraChange).count() > settleTime) {
+    return 1.f;
+  }
+
+  if (latestRenderTime <= 0.f) {
+    return windowState.renderScale;
+  }
+
+  float scale = finishedFrameScale * std::sqrt(targetFrameTime / latestRenderTime);
+  scale = std::min(std::max(scale, minRenderScale), 1.f);
+
+  // don't resize the frames for small changes
+  float current = windowState.renderScale;
+  if (std::fabs(scale - current) < 0.1f * current) {
+    return current;
+  }
+  return scale;
+}
+
+// Compares the image of frame fi with its image from the previous
+// time it was displayed (the two frames may use the same random
+// sequences, so their images can't be compared with each other). With
+// the previous image I_n averaging n samples and the current one I_m
+// averaging m > n, I_n - I_m = (m - n) / m * (I_n - J), where J averages
+// the m - n new samples. So its variance is (m - n) / (n * m) times the
+// per-sample variance, and n / (m - n) times the mean squared difference
+// estimates the variance of the current image (in 8 bit colors, so it
+// doesn't get much below 1e-6)
+void GLFWDistribANARIWindow::estimateVariance(
+    const uint32_t *pixels, int width, int height, int fi)
+{
+  size_t numPixels = size_t(width) * height;
+  int n = previousImageSamples[fi];
+  int m = frameSamples[fi];
+  if (frameEpoch[fi] == previousImageEpoch[fi]
+      && previousImage[fi].size() == numPixels && m > n && n > 0) {
+    const std::vector<uint32_t> &previous = previousImage[fi];
+    double sum = 0.0;
+    for (size_t i = 0; i < numPixels; ++i) {
+      for (int c = 0; c < 3; ++c) {
+        int d = int((pixels[i] >> (8 * c)) & 0xff)
+            - int((previous[i] >> (8 * c)) & 0xff);
+        sum += d * d;
+      }
+    }
+    double msd = sum / (3.0 * numPixels) / (255.0 * 255.0);
+    latestVariance = float(msd * n / (m - n));
+  }
+
+  previousImage[fi].assign(pixels, pixels + numPixels);
+  previousImageSamples[fi] = m;
+  previousImageEpoch[fi] = frameEpoch[fi];
+}
+
+void GLFWDistribANARIWindow::createFrames()
+{
+  for (auto &f : frames) {
+    if (f)
+      anari::release(device, f);
+
+    f = anari::newObject<anari::Frame>(device);
+    anari::setParameter(device, f, "size", (uint2)windowSize);
+    anari::setParameter(device, f, "channel.color", ANARI_UFIXED8_RGBA_SRGB);
+    anari::setParameter(device, f, "world", world);
+    anari::setParameter(device, f, "renderer", renderer);
+    anari::setParameter(device, f, "camera", camera);
+    anari::commitParameters(device, f);
+  }
+
+  frameSizes[0] = frameSizes[1] = (uint2)windowSize;
+
+  // the frame to display was replaced
+  newFrameToDisplay = false;
+}
+
+// Collective; each rank contributes its average render time since
+// the last gather
+void GLFWDistribANARIWindow::gatherRenderTimes()
+{
+  float avgRenderTime = float(accumulatedRenderTime / numMeasuredFrames);
+  accumulatedRenderTime = 0.0;
+  numMeasuredFrames = 0;
+
+  std::vector<float> renderTimes(mpiWorldSize);
+  MPI_Gather(&avgRenderTime, 1, MPI_FLOAT,
+      renderTimes.data(), 1, MPI_FLOAT, 0, rebalanceComm);
+
+  if (mpiRank != 0) {
+    return;
+  }
+
+  double maxTime = 0.0, avgTime = 0.0;
+  for (int i = 0; i < mpiWorldSize; ++i) {
+    maxTime = std::max(maxTime, double(renderTimes[i]));
+    avgTime += renderTimes[i];
+  }
+  avgTime /= mpiWorldSize;
+
+  if (avgTime > 0.0 && maxTime / avgTime > rebalanceThreshold) {
+    rankRenderTimes = renderTimes;
+    // picked up by all ranks with the next window state broadcast
+    windowState.rebalance = true;
+  }
+}
+
+void GLFWDistribANARIWindow::rebalance()
+{
+  rankRenderTimes.resize(mpiWorldSize);
+  MPI_Bcast(rankRenderTimes.data(), mpiWorldSize, MPI_FLOAT, 0, rebalanceComm);
+
+  rebalanceCallback(rankRenderTimes);
+
+  // the new assignment needs fresh measurements
+  accumulatedRenderTime = 0.0;
+  numMeasuredFrames = 0;
 }
 
 void GLFWDistribANARIWindow::addObjectToCommit(ANARIObject obj)
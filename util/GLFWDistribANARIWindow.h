@@ -2,10 +2,13 @@
 #pragma once
 
 #include <GLFW/glfw3.h>
+#include <chrono>
 #include <functional>
 #include <future>
 #include <memory>
+#include <vector>
 #include "ArcballCamera.h"
+#include "CommandChannel.h"
 #include "TransactionalBuffer.h"
 // anari
 #include "anari/anari_cpp.hpp"
@@ -15,7 +18,14 @@ struct WindowState
   bool quit;
   bool cameraChanged;
   bool fbSizeChanged;
+  bool rebalance;
+  // rank 0's in-flight frame is done, finish it and, if render
+  // is set, start the next one
+  bool nextFrame;
+  bool render;
   int spp;
+  // frame size relative to the window size
+  float renderScale;
   anari::math::int2 windowSize;
   anari::math::float3 eyePos;
   anari::math::float3 lookDir;
@@ -40,13 +50,48 @@ class GLFWDistribANARIWindow
   anari::World getWorld();
   void setWorld(anari::World newWorld);
 
+  // Restart progressive accumulation, e.g., after the scene changed;
+  // on rank 0, this also resumes rendering once converged
   void resetAccumulation();
 
+  // Progressive mode: stop rendering (on all ranks) once spp samples
+  // per pixel were accumulated, or the estimated per-pixel variance
+  // (of [0,1] color values) drops below varianceThreshold; 0 disables
+  // the respective criterion. Rendering resumes with the next change
+  void setAccumulationTarget(int spp, float varianceThreshold = 0.f);
+
+  // Adaptive resolution: while the camera moves, render smaller frames
+  // (down to minScale times the window size) so that frames take about
+  // targetFrameTime seconds, and upscale them to the window; 0 disables
+  void setTargetFrameTime(float targetFrameTime, float minScale = 0.25f);
+
+  // Frames and samples per pixel accumulated since the last change, in
+  // the most recently finished (i.e., displayed) frame
+  int getAccumulatedFrames() const;
+  int getAccumulatedSamples() const;
+
+  // Rank 0: variance estimate of the displayed image, -1 if unknown
+  float getVarianceEstimate() const;
+
+  // Samples per pixel, set on rank 0 (e.g., from the UI); the value
+  // of the current frame is the same on all ranks
+  void setPixelSamples(int spp);
+  int getPixelSamples() const;
+
   void registerDisplayCallback(
       std::function<void(GLFWDistribANARIWindow *)> callback);
 
   void registerImGuiCallback(std::function<void()> callback);
 
+  // Opt-in load balancing: measure per-rank render times and, when the
+  // max/avg imbalance averaged over numFrames exceeds threshold, call
+  // callback with the per-rank times on all ranks. Collective, must be
+  // registered on all ranks.
+  void registerRebalanceCallback(
+      std::function<void(const std::vector<float> &)> callback,
+      float threshold = 1.2f,
+      int numFrames = 32);
+
   void mainLoop();
 
   void addObjectToCommit(ANARIObject obj);
@@ -57,6 +102,15 @@ class GLFWDistribANARIWindow
   void display();
   void startNewANARIFrame();
   void waitOnANARIFrame();
+  bool isANARIFrameReady();
+  void createFrames();
+  bool accumulationConverged() const;
+  float adaptiveRenderScale() const;
+  void beginUpload(const uint32_t *pixels, int width, int height);
+  void finishUpload();
+  void estimateVariance(const uint32_t *pixels, int width, int height, int fi);
+  void gatherRenderTimes();
+  void rebalance();
   void updateTitleBar();
 
   static GLFWDistribANARIWindow *activeWindow;
@@ -78,15 +132,67 @@ class GLFWDistribANARIWindow
 
   // ANARI objects managed by this class
   anari::Camera camera = nullptr;
-  anari::Frame frame = nullptr;
 
-  std::future<void> currentFrame;
+  // Double-buffered frames: one renders while rank 0 maps and
+  // displays the other one
+  anari::Frame frames[2] = {nullptr, nullptr};
+  // each frame is resized right before it renders, so the other one
+  // can still be displayed
+  anari::math::uint2 frameSizes[2];
+  float frameScales[2] = {1.f, 1.f};
+  int renderIndex{0};
+  bool frameInFlight{false};
+  // rank 0: frames[1-renderIndex] holds an image not yet displayed
+  bool newFrameToDisplay{false};
+
+  // adaptive resolution, see setTargetFrameTime()
+  float targetFrameTime{0.f};
+  float minRenderScale{0.25f};
+  // scale of the last finished frame, i.e., of latestRenderTime
+  float finishedFrameScale{1.f};
+  std::chrono::high_resolution_clock::time_point lastCameraChange;
+
+  // progressive accumulation, see setAccumulationTarget(); each frame
+  // accumulates its own renders (i.e., every other one)
+  int frameRenders[2] = {0, 0};
+  int frameSamples[2] = {0, 0};
+  int accumulationTargetSpp{0};
+  float varianceThreshold{0.f};
+
+  // The variance is estimated from consecutive images of the same frame
+  // (rank 0); images are only compared within one accumulation epoch
+  int accumulationEpoch{0};
+  int frameEpoch[2] = {0, 0};
+  std::vector<uint32_t> previousImage[2];
+  int previousImageSamples[2] = {0, 0};
+  int previousImageEpoch[2] = {-1, -1};
+  float latestVariance{-1.f};
 
   // List of ANARI handles to commit before the next frame
   util::containers::TransactionalBuffer<ANARIObject> objectsToCommit;
 
   // OpenGL framebuffer texture
   GLuint framebufferTexture = 0;
+  anari::math::int2 textureSize{0};
+
+  // pixel buffer objects the frames are uploaded from, see
+  // beginUpload(); a ring if fences are supported, otherwise a single
+  // one, and empty if not supported at all
+  struct PixelBuffer
+  {
+    GLuint buffer = 0;
+    size_t numBytes = 0;
+    // GLsync, signaled once the texture is updated from this buffer
+    void *uploaded = nullptr;
+  };
+  static const int numPixelBuffers = 3;
+  std::vector<PixelBuffer> pixelBuffers;
+  unsigned nextPixelBuffer{0};
+  // upload started by beginUpload(); uploadBuffer is null if the pixels
+  // are uploaded directly
+  const uint32_t *uploadPixels = nullptr;
+  PixelBuffer *uploadBuffer = nullptr;
+  std::future<void> pendingCopy;
 
   // optional registered display callback, called before every display()
   std::function<void(GLFWDistribANARIWindow *)> displayCallback;
@@ -100,6 +206,32 @@ class GLFWDistribANARIWindow
   // FPS measurement of last frame
   float latestFPS{0.f};
 
+  // optional registered rebalance callback, see registerRebalanceCallback()
+  std::function<void(const std::vector<float> &)> rebalanceCallback;
+  float rebalanceThreshold{1.2f};
+  int rebalanceNumFrames{32};
+
+  // render time measurement, for rebalancing
+  std::chrono::high_resolution_clock::time_point renderStart;
+  float latestRenderTime{0.f};
+
+  // this rank's render times summed over the last frames
+  double accumulatedRenderTime{0.0};
+  int numMeasuredFrames{0};
+
+  // averaged per-rank render times that triggered rebalancing (rank 0)
+  std::vector<float> rankRenderTimes;
+
+  // rebalancing's collectives run on their own communicator, so they
+  // don't interfere with the device's
+  MPI_Comm rebalanceComm{MPI_COMM_NULL};
+
   // The window state to be sent out over MPI to the other rendering processes
   WindowState windowState;
+
+  // The window state of the current frame, same on all ranks
+  WindowState frameState;
+
+  // Sends the window state from rank 0 when a frame starts
+  std::unique_ptr<util::CommandChannel> commandChannel;
 };
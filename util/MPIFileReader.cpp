@@ -0,0 +1,138 @@
+#include <algorithm>
+#include <climits>
+#include <stdexcept>
+#include "MPIFileReader.h"
+
+namespace util {
+
+  // Upper bound for the bytes read per collective call; MPI counts
+  // and blocklengths are ints
+  static const uint64_t maxBytesPerRound = 1ull<<30;
+
+  MPIFileReader::MPIFileReader(const std::string &fname, MPI_Comm comm)
+    : comm(comm)
+  {
+    MPI_Info info;
+    MPI_Info_create(&info);
+    MPI_Info_set(info, "romio_cb_read", "enable");
+
+    int err = MPI_File_open(comm, fname.c_str(), MPI_MODE_RDONLY, info, &file);
+    MPI_Info_free(&info);
+
+    if (err != MPI_SUCCESS) {
+      throw std::runtime_error("Failed to open file " + fname);
+    }
+  }
+
+  MPIFileReader::~MPIFileReader() {
+    MPI_File_close(&file);
+  }
+
+  bool MPIFileReader::readAt(uint64_t offset, void *dst, size_t len) {
+    if (len > INT_MAX)
+      return false;
+
+    MPI_Status status;
+    int err = MPI_File_read_at_all(file, offset, dst, (int)len, MPI_BYTE, &status);
+    if (err != MPI_SUCCESS)
+      return false;
+
+    int count = 0;
+    MPI_Get_count(&status, MPI_BYTE, &count);
+    return count == (int)len;
+  }
+
+  bool MPIFileReader::readAll(std::vector<Extent> extents) {
+    // File views require monotonically increasing offsets
+    std::sort(extents.begin(), extents.end(),
+              [](const Extent &a, const Extent &b) {
+                return a.offset < b.offset;
+              });
+
+    // Split into rounds of at most maxBytesPerRound bytes
+    std::vector<std::vector<Extent>> rounds(1);
+    uint64_t roundBytes = 0;
+    for (Extent e : extents) {
+      while (e.numBytes > 0) {
+        if (roundBytes == maxBytesPerRound) {
+          rounds.emplace_back();
+          roundBytes = 0;
+        }
+        uint64_t n = std::min(e.numBytes, maxBytesPerRound-roundBytes);
+        rounds.back().push_back({e.offset, n, e.dst});
+        e.offset += n;
+        e.numBytes -= n;
+        e.dst = (uint8_t *)e.dst + n;
+        roundBytes += n;
+      }
+    }
+    if (rounds.back().empty())
+      rounds.pop_back();
+
+    // Ranks with less (or no) data still take part in every round
+    int numRounds = (int)rounds.size();
+    int maxNumRounds = 0;
+    MPI_Allreduce(&numRounds, &maxNumRounds, 1, MPI_INT, MPI_MAX, comm);
+
+    bool ok = true;
+    for (int r=0; r<maxNumRounds; ++r) {
+      MPI_Datatype fileType = MPI_BYTE;
+      MPI_Datatype memType = MPI_BYTE;
+      void *buf = nullptr;
+      int count = 0;
+      uint64_t expectedBytes = 0;
+
+      if (r < numRounds) {
+        const std::vector<Extent> &pieces = rounds[r];
+        int n = (int)pieces.size();
+        std::vector<int> lengths(n);
+        std::vector<MPI_Aint> fileDispls(n);
+        std::vector<MPI_Aint> memDispls(n);
+        for (int i=0; i<n; ++i) {
+          lengths[i] = (int)pieces[i].numBytes;
+          fileDispls[i] = (MPI_Aint)pieces[i].offset;
+          MPI_Get_address(pieces[i].dst, &memDispls[i]);
+          expectedBytes += pieces[i].numBytes;
+        }
+
+        MPI_Type_create_hindexed(n, lengths.data(), fileDispls.data(), MPI_BYTE, &fileType);
+        MPI_Type_commit(&fileType);
+
+        // Scatter straight into the destination buffers
+        MPI_Type_create_hindexed(n, lengths.data(), memDispls.data(), MPI_BYTE, &memType);
+        MPI_Type_commit(&memType);
+
+        buf = MPI_BOTTOM;
+        count = 1;
+      }
+
+      MPI_File_set_view(file, 0, MPI_BYTE, fileType, "native", MPI_INFO_NULL);
+
+      MPI_Status status;
+      if (MPI_File_read_at_all(file, 0, buf, count, memType, &status) != MPI_SUCCESS) {
+        ok = false;
+      } else if (count > 0) {
+        MPI_Count numBytes = 0;
+        MPI_Get_elements_x(&status, MPI_BYTE, &numBytes);
+        ok &= (uint64_t)numBytes == expectedBytes;
+      }
+
+      if (r < numRounds) {
+        MPI_Type_free(&fileType);
+        MPI_Type_free(&memType);
+      }
+    }
+
+    // Back to a plain byte view for readAt()
+    MPI_File_set_view(file, 0, MPI_BYTE, MPI_BYTE, "native", MPI_INFO_NULL);
+
+    return ok;
+  }
+
+  uint64_t MPIFileReader::nbytes() const {
+    MPI_Offset size = 0;
+    MPI_File_get_size(file, &size);
+    return size;
+  }
+
+} // ::util
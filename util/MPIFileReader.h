@@ -0,0 +1,46 @@
+#pragma once
+
+// std
+#include <cstdint>
+#include <string>
+#include <vector>
+// mpi
+#include <mpi.h>
+
+namespace util {
+
+  // ======================================================
+  // Collective file reader on top of MPI-IO. All ranks in
+  // the communicator have to construct the reader and call
+  // readAt()/readAll() in the same order, so the MPI
+  // library can aggregate the requests (two-phase I/O)
+  // ======================================================
+  class MPIFileReader {
+    MPI_File file;
+    MPI_Comm comm;
+
+  public:
+    // A byte range in the file and where it goes in memory
+    struct Extent {
+      uint64_t offset;
+      uint64_t numBytes;
+      void *dst;
+    };
+
+    MPIFileReader(const std::string &fname, MPI_Comm comm = MPI_COMM_WORLD);
+    ~MPIFileReader();
+
+    MPIFileReader(const MPIFileReader &) = delete;
+    MPIFileReader& operator=(const MPIFileReader &) = delete;
+
+    // Collective; all ranks read the same bytes (e.g., headers)
+    bool readAt(uint64_t offset, void *dst, size_t len);
+
+    // Collective; each rank reads its own list of extents, using
+    // a file view built from the extents' offsets
+    bool readAll(std::vector<Extent> extents);
+
+    uint64_t nbytes() const;
+  };
+
+} // ::util
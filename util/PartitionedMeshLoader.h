@@ -1,14 +1,21 @@
 #pragma once
 
 // std
+#include <cstring>
 #include <iostream>
 #include <fstream>
+#include <map>
+#include <memory>
 #include <sstream>
+#include <unordered_map>
 #include <vector>
 // anari
 #include "anari/anari_cpp.hpp" // ours
+#include "FileMapping.h"
+#include "MPIFileReader.h"
 #include "mesh.h"
 #include "Partitioner.h"
+#include "TriFile.h"
 
 namespace util {
   // ======================================================
@@ -17,84 +24,181 @@ namespace util {
   // ======================================================
   struct PartitionedMeshLoader
   {
+    // Stream: read the assigned clusters into std::vectors (copy)
+    // Mapped: mmap the .tri file and hand pointers into the
+    //         mapping to ANARI (zero-copy, loadANARI() only)
+    // MPIIO:  like Stream, but read collectively through MPI-IO;
+    //         all ranks of MPI_COMM_WORLD must call load()
+    enum class Mode { Stream, Mapped, MPIIO, };
+
+    PartitionedMeshLoader(Mode mode = Mode::Stream,
+                          Partitioner::Strategy strategy = Partitioner::Strategy::KD)
+      : mode(mode)
+      , strategy(strategy)
+    {}
+
+    // Owns the communicator that clusters are migrated on
+    PartitionedMeshLoader(const PartitionedMeshLoader &) = delete;
+    PartitionedMeshLoader &operator=(const PartitionedMeshLoader &) = delete;
+
+    ~PartitionedMeshLoader() {
+      int finalized = 0;
+      MPI_Finalized(&finalized);
+      if (migrationComm != MPI_COMM_NULL && !finalized)
+        MPI_Comm_free(&migrationComm);
+    }
+
     Mesh::SP load(std::string fileName, int commRank, int commSize) {
-      std::vector<Cluster> clusters;
+      if (mode == Mode::MPIIO)
+        return loadMPIIO(fileName, commRank, commSize);
 
       // Load binary tris
       Mesh::SP triMesh = std::make_shared<Mesh>();
-      Geometry::SP geom = std::make_shared<Geometry>();
-      uint64_t numClusters, numVerts;
 
       std::ifstream ifs(fileName,std::ios::binary);
       if (!ifs.good()) {
         std::cerr << "cannot open file: " << fileName << '\n';
         return nullptr;
       }
-      ifs.read((char *)&numClusters,sizeof(numClusters));
-      ifs.read((char *)&triMesh->bounds,sizeof(triMesh->bounds));
-      ifs.read((char *)&numVerts,sizeof(numVerts));
-      geom->vertex.resize(numVerts);
-      ifs.read((char *)geom->vertex.data(),sizeof(float3)*numVerts);
 
-      clusters.resize(numClusters);
+      TriFile tri;
+      bool ok = tri.readHeader([&](uint64_t offset, void *dst, size_t len) {
+        ifs.seekg(offset);
+        ifs.read((char *)dst,len);
+        return ifs.good();
+      });
+      if (!ok) {
+        std::cerr << "cannot read header of file: " << fileName << '\n';
+        return nullptr;
+      }
+
+      triMesh->bounds = tri.bounds;
 
-      uint64_t clustersPos = ifs.tellg();
+      partition(tri,commSize);
 
-      for (unsigned i=0; i<numClusters; ++i) {
-        uint64_t numIndices;
-        box3 domainBounds;
-        ifs.read((char *)&numIndices,sizeof(numIndices));
-        ifs.read((char *)&domainBounds,sizeof(domainBounds));
-        uint64_t cur = ifs.tellg();
-        ifs.seekg(cur+sizeof(int3)*numIndices);
-        clusters[i] = {
-          (int)i, // clusterID
-          -1, // rankID; we don't know this yet
-          domainBounds
-        };
+      // Legacy files store one vertex array for all clusters; that
+      // is read once and compacted per cluster below
+      std::vector<float3> sharedVertices;
+
+      std::vector<unsigned> myClusters;
+      size_t myNumTriangles = 0;
+      for (unsigned i=0; i<tri.clusters.size(); ++i) {
+        if (!partitioner->assignedTo(i,commRank))
+          continue;
+
+        const TriFile::Cluster &c = tri.clusters[i];
+        Geometry::SP geom = std::make_shared<Geometry>();
+
+        if (tri.sharedVertices()) {
+          if (sharedVertices.empty()) {
+            sharedVertices.resize(c.numVerts);
+            ifs.seekg(c.vertexOffset);
+            ifs.read((char *)sharedVertices.data(),sizeof(float3)*c.numVerts);
+          }
+        } else {
+          geom->vertex.resize(c.numVerts);
+          ifs.seekg(c.vertexOffset);
+          ifs.read((char *)geom->vertex.data(),sizeof(float3)*c.numVerts);
+        }
+
+        geom->index.resize(c.numIndices);
+        ifs.seekg(c.indexOffset);
+        ifs.read((char *)geom->index.data(),sizeof(int3)*c.numIndices);
+
+        if (tri.sharedVertices())
+          compactGeometry(sharedVertices,*geom);
+
+        triMesh->geoms.push_back(geom);
+
+        myClusters.push_back(i);
+        myNumTriangles += c.numIndices;
       }
+      printStats(myClusters,myNumTriangles,commRank);
 
-      auto partitioner = std::make_shared<Partitioner>(clusters,commSize);
-      partitioner->partitionRoundRobin();
+      loadedClusters = myClusters;
 
-      ifs.seekg(clustersPos);
+      return triMesh;
+    }
+
+    // ====================================================
+    // Collective variant of load(): the header and cluster
+    // directory are read with MPI_File_read_at_all, then each
+    // rank reads all of its clusters with a single file view
+    // ====================================================
+    Mesh::SP loadMPIIO(std::string fileName, int commRank, int commSize) {
+      Mesh::SP triMesh = std::make_shared<Mesh>();
+
+      std::unique_ptr<MPIFileReader> reader;
+      try {
+        reader.reset(new MPIFileReader(fileName, MPI_COMM_WORLD));
+      } catch (...) {
+        std::cerr << "cannot open file: " << fileName << '\n';
+        return nullptr;
+      }
+
+      TriFile tri;
+      bool ok = tri.readHeader([&](uint64_t offset, void *dst, size_t len) {
+        return reader->readAt(offset,dst,len);
+      });
+      if (!ok) {
+        std::cerr << "cannot read header of file: " << fileName << '\n';
+        return nullptr;
+      }
+
+      triMesh->bounds = tri.bounds;
+
+      partition(tri,commSize);
+
+      std::vector<float3> sharedVertices;
+      std::vector<MPIFileReader::Extent> extents;
 
       std::vector<unsigned> myClusters;
       size_t myNumTriangles = 0;
-      for (unsigned i=0; i<numClusters; ++i) {
-        uint64_t numIndices;
-        box3 domainBounds;
-        ifs.read((char *)&numIndices,sizeof(numIndices));
-        if (partitioner->assignedTo(i,commRank)) {
-          ifs.read((char *)&domainBounds,sizeof(domainBounds));
-          geom->index.resize(numIndices);
-          ifs.read((char *)geom->index.data(),sizeof(int3)*numIndices);
-          triMesh->geoms.push_back(geom);
-          geom = std::make_shared<Geometry>();
-
-          myClusters.push_back(i);
-          myNumTriangles += numIndices;
+      for (unsigned i=0; i<tri.clusters.size(); ++i) {
+        if (!partitioner->assignedTo(i,commRank))
+          continue;
+
+        const TriFile::Cluster &c = tri.clusters[i];
+        Geometry::SP geom = std::make_shared<Geometry>();
+
+        if (tri.sharedVertices()) {
+          if (sharedVertices.empty()) {
+            sharedVertices.resize(c.numVerts);
+            extents.push_back({c.vertexOffset,
+                               sizeof(float3)*c.numVerts,
+                               sharedVertices.data()});
+          }
         } else {
-          ifs.read((char *)&domainBounds,sizeof(domainBounds));
-          uint64_t cur = ifs.tellg();
-          ifs.seekg(cur+sizeof(int3)*numIndices);
+          geom->vertex.resize(c.numVerts);
+          extents.push_back({c.vertexOffset,
+                             sizeof(float3)*c.numVerts,
+                             geom->vertex.data()});
         }
+
+        geom->index.resize(c.numIndices);
+        extents.push_back({c.indexOffset,
+                           sizeof(int3)*c.numIndices,
+                           geom->index.data()});
+
+        triMesh->geoms.push_back(geom);
+
+        myClusters.push_back(i);
+        myNumTriangles += c.numIndices;
       }
-      std::stringstream s;
-      s << "Clusters assigned to (commRank): ("
-        << commRank << ")\n\t";
-      for (size_t i=0; i<myClusters.size(); ++i) {
-        s << myClusters[i];
-        if (i < myClusters.size()-1)
-          s << ", ";
-        else
-          s << '\n';
+
+      if (!reader->readAll(extents)) {
+        std::cerr << "cannot read clusters from file: " << fileName << '\n';
+        return nullptr;
       }
-      s << "\t# clusters on (" << commRank << "): "
-        << myClusters.size() << '\n';
-      s << "\t# triangles on (" << commRank << "): "
-        << prettyNumber(myNumTriangles) << '\n';
-      std::cout << s.str();
+
+      if (tri.sharedVertices()) {
+        for (auto &geom : triMesh->geoms)
+          compactGeometry(sharedVertices,*geom);
+      }
+
+      printStats(myClusters,myNumTriangles,commRank);
+
+      loadedClusters = myClusters;
 
       return triMesh;
     }
@@ -120,10 +224,10 @@ namespace util {
         size_t index=0;
         for (size_t j=0; j<geom->index.size(); ++j) {
           int3 idx(index,index+1,index+2);
-          ourVertices[idx.x] = geom->vertex[geom->index[i].x];
-          ourVertices[idx.y] = geom->vertex[geom->index[i].y];
-          ourVertices[idx.z] = geom->vertex[geom->index[i].z];
-          geom->index[i] = idx;
+          ourVertices[idx.x] = geom->vertex[geom->index[j].x];
+          ourVertices[idx.y] = geom->vertex[geom->index[j].y];
+          ourVertices[idx.z] = geom->vertex[geom->index[j].z];
+          geom->index[j] = idx;
           index += 3;
         }
         geom->vertex = ourVertices;
@@ -138,8 +242,13 @@ namespace util {
                                            int commSize,
                                            box3 *bounds=NULL) {
 
+      if (mode == Mode::Mapped)
+        return loadANARIMapped(device, fileName, commRank, commSize, bounds);
+
       std::vector<anari::Geometry> res;
       auto triMesh = load(fileName, commRank, commSize);
+      if (!triMesh)
+        return res;
 
       for (size_t i=0; i<triMesh->geoms.size(); ++i) {
         const Geometry::SP &geom = triMesh->geoms[i];
@@ -164,6 +273,321 @@ namespace util {
       return res;
     }
 
+    // ====================================================
+    // Zero-copy variant of loadANARI(): the .tri file is
+    // mapped into memory and the ANARI arrays point right
+    // into the mapping. Each array holds a reference to the
+    // mapping that is dropped by the array's deleter, so
+    // only the pages that the device actually touches are
+    // ever read from disk
+    // ====================================================
+    std::vector<anari::Geometry> loadANARIMapped(anari::Device device,
+                                                 std::string fileName,
+                                                 int commRank,
+                                                 int commSize,
+                                                 box3 *bounds=NULL) {
+
+      std::vector<anari::Geometry> res;
+
+      std::shared_ptr<FileMapping> fm;
+      try {
+        fm = std::make_shared<FileMapping>(fileName);
+      } catch (...) {
+        std::cerr << "cannot open file: " << fileName << '\n';
+        return res;
+      }
+
+      const uint8_t *base = fm->data();
+      const size_t nbytes = fm->nbytes();
+
+      TriFile tri;
+      bool ok = tri.readHeader([&](uint64_t offset, void *dst, size_t len) {
+        if (offset+len > nbytes)
+          return false;
+        memcpy(dst,base+offset,len);
+        return true;
+      });
+      if (!ok) {
+        std::cerr << "cannot read header of file: " << fileName << '\n';
+        return res;
+      }
+
+      partition(tri,commSize);
+
+      // The device reads the clusters straight from the mapping, so
+      // they must lie within the file
+      auto fits = [&](uint64_t offset, uint64_t num, size_t size) {
+        return offset <= nbytes && num <= (nbytes-offset)/size;
+      };
+      for (unsigned i=0; i<tri.clusters.size(); ++i) {
+        if (!partitioner->assignedTo(i,commRank))
+          continue;
+
+        const TriFile::Cluster &c = tri.clusters[i];
+        if (!fits(c.vertexOffset,c.numVerts,sizeof(float3))
+         || !fits(c.indexOffset,c.numIndices,sizeof(int3))) {
+          std::cerr << "cluster " << i << " exceeds file: " << fileName << '\n';
+          return res;
+        }
+      }
+
+      auto newMappedArray = [&](const auto *ptr, uint64_t num) {
+        return anari::newArray1D(device,
+                                 ptr,
+                                 releaseMapping,
+                                 new std::shared_ptr<FileMapping>(fm),
+                                 num);
+      };
+
+      // Legacy files: the vertex array is shared by all clusters
+      anari::Array1D sharedVertexData = nullptr;
+
+      std::vector<unsigned> myClusters;
+      size_t myNumTriangles = 0;
+      for (unsigned i=0; i<tri.clusters.size(); ++i) {
+        if (!partitioner->assignedTo(i,commRank))
+          continue;
+
+        const TriFile::Cluster &c = tri.clusters[i];
+
+        auto ageom = anari::newObject<anari::Geometry>(device, "triangle");
+
+        const float3 *vertices = (const float3 *)(base+c.vertexOffset);
+        if (tri.sharedVertices()) {
+          if (!sharedVertexData)
+            sharedVertexData = newMappedArray(vertices,c.numVerts);
+          anari::setParameter(device, ageom, "vertex.position", sharedVertexData);
+        } else {
+          anari::Array1D data = newMappedArray(vertices,c.numVerts);
+          anari::setAndReleaseParameter(device, ageom, "vertex.position", data);
+        }
+
+        using uint3 = anari::math::uint3;
+        anari::Array1D data
+            = newMappedArray((const uint3 *)(base+c.indexOffset),c.numIndices);
+        anari::setAndReleaseParameter(device, ageom, "primitive.index", data);
+
+        anari::commitParameters(device, ageom);
+        res.push_back(ageom);
+
+        myClusters.push_back(i);
+        myNumTriangles += c.numIndices;
+      }
+
+      if (sharedVertexData)
+        anari::release(device, sharedVertexData);
+
+      printStats(myClusters,myNumTriangles,commRank);
+
+      loadedClusters = myClusters;
+
+      if (bounds) {
+        *bounds = tri.bounds;
+      }
+
+      return res;
+    }
+
+    void partition(const TriFile &tri, int commSize) {
+      clusters.resize(tri.clusters.size());
+      clusterTriangles.resize(tri.clusters.size());
+      for (unsigned i=0; i<tri.clusters.size(); ++i) {
+        clusters[i] = {
+          (int)i, // clusterID
+          -1, // rankID; we don't know this yet
+          tri.clusters[i].domain,
+          (float)tri.clusters[i].numIndices // cost
+        };
+        clusterTriangles[i] = tri.clusters[i].numIndices;
+      }
+
+      partitioner = std::make_shared<Partitioner>(clusters,commSize);
+      partitioner->partition(strategy);
+      if (partitioner->regionsOverlap())
+        std::cerr << "Warning: rank regions overlap, compositing may be wrong\n";
+    }
+
+    // ====================================================
+    // Bounds of the region owned by commRank (valid after
+    // loading); meant to be set as the world's "region"
+    // ====================================================
+    box3 regionBounds(int commRank) const {
+      if (!partitioner)
+        return { float3(1e30f), float3(-1e30f) };
+      return partitioner->regionBounds(commRank);
+    }
+
+    // ====================================================
+    // Re-partition from measured per-rank render times and
+    // migrate cluster data between ranks accordingly. mesh
+    // must be the result of load() on this rank; collective
+    // over MPI_COMM_WORLD. Returns the clusters that were
+    // added to / removed from this rank
+    // ====================================================
+    struct Migration {
+      std::vector<unsigned> added, removed;
+    };
+
+    Migration rebalance(Mesh::SP mesh,
+                        const std::vector<float> &rankTimes,
+                        int commRank,
+                        int commSize) {
+      Migration res;
+      if (!partitioner || (int)rankTimes.size() != commSize)
+        return res;
+
+      // Distribute each rank's time over its clusters, proportional
+      // to their triangle counts
+      std::vector<double> rankTriangles(commSize,0.0);
+      for (int r=0; r<commSize; ++r) {
+        for (auto id : partitioner->perRank[r])
+          rankTriangles[r] += clusterTriangles[id];
+      }
+
+      std::vector<int> oldRank(clusters.size(),-1);
+      for (int r=0; r<commSize; ++r) {
+        for (auto id : partitioner->perRank[r]) {
+          oldRank[id] = r;
+          clusters[id].cost = rankTriangles[r] > 0.0
+              ? float(rankTimes[r]*clusterTriangles[id]/rankTriangles[r])
+              : 0.f;
+        }
+      }
+
+      partitioner->partition(Partitioner::Strategy::WeightedKD);
+
+      std::vector<int> newRank(clusters.size(),-1);
+      for (int r=0; r<commSize; ++r) {
+        for (auto id : partitioner->perRank[r])
+          newRank[id] = r;
+      }
+
+      std::map<unsigned,Geometry::SP> mine;
+      for (size_t i=0; i<loadedClusters.size(); ++i)
+        mine[loadedClusters[i]] = mesh->geoms[i];
+
+      // Send clusters we give away; messages between a pair of ranks
+      // are matched in ascending cluster order (MPI messages with
+      // the same source and tag don't overtake each other)
+      //
+      // Vertices and triangles are sent as 12-byte elements, so the
+      // counts fit into an int for clusters of more than 2 GiB
+      static_assert(sizeof(float3)==sizeof(int3),"float3 and int3 differ in size");
+      MPI_Datatype vec3Type;
+      MPI_Type_contiguous((int)sizeof(float3), MPI_BYTE, &vec3Type);
+      MPI_Type_commit(&vec3Type);
+
+      // Migrate on a communicator of our own, so the probes can't
+      // match messages of the device or the application
+      if (migrationComm == MPI_COMM_NULL)
+        MPI_Comm_dup(MPI_COMM_WORLD, &migrationComm);
+
+      std::vector<MPI_Request> requests;
+      for (unsigned i=0; i<clusters.size(); ++i) {
+        if (oldRank[i] != commRank || newRank[i] == commRank)
+          continue;
+        const Geometry::SP &geom = mine[i];
+        requests.emplace_back();
+        MPI_Isend(geom->vertex.data(), (int)geom->vertex.size(),
+                  vec3Type, newRank[i], 0, migrationComm, &requests.back());
+        requests.emplace_back();
+        MPI_Isend(geom->index.data(), (int)geom->index.size(),
+                  vec3Type, newRank[i], 1, migrationComm, &requests.back());
+        res.removed.push_back(i);
+      }
+
+      // Receive the clusters we take over
+      for (unsigned i=0; i<clusters.size(); ++i) {
+        if (newRank[i] != commRank || oldRank[i] == commRank)
+          continue;
+        Geometry::SP geom = std::make_shared<Geometry>();
+        MPI_Status status;
+        int count = 0;
+
+        MPI_Probe(oldRank[i], 0, migrationComm, &status);
+        MPI_Get_count(&status, vec3Type, &count);
+        geom->vertex.resize(count);
+        MPI_Recv(geom->vertex.data(), count, vec3Type, oldRank[i], 0,
+                 migrationComm, MPI_STATUS_IGNORE);
+
+        MPI_Probe(oldRank[i], 1, migrationComm, &status);
+        MPI_Get_count(&status, vec3Type, &count);
+        geom->index.resize(count);
+        MPI_Recv(geom->index.data(), count, vec3Type, oldRank[i], 1,
+                 migrationComm, MPI_STATUS_IGNORE);
+
+        mine[i] = geom;
+        res.added.push_back(i);
+      }
+
+      MPI_Waitall((int)requests.size(), requests.data(), MPI_STATUSES_IGNORE);
+      MPI_Type_free(&vec3Type);
+
+      for (auto id : res.removed)
+        mine.erase(id);
+
+      mesh->geoms.clear();
+      loadedClusters.clear();
+      size_t myNumTriangles = 0;
+      for (auto &kv : mine) {
+        mesh->geoms.push_back(kv.second);
+        loadedClusters.push_back(kv.first);
+        myNumTriangles += kv.second->index.size();
+      }
+
+      printStats(loadedClusters,myNumTriangles,commRank);
+
+      return res;
+    }
+
+    // ====================================================
+    // Gather the vertices referenced by geom's indices from
+    // a shared vertex array, and make the indices local
+    // ====================================================
+    void compactGeometry(const std::vector<float3> &sharedVertices, Geometry &geom) {
+      std::unordered_map<int,int> remap;
+      geom.vertex.clear();
+      auto local = [&](int index) {
+        auto it = remap.find(index);
+        if (it != remap.end())
+          return it->second;
+        int localIndex = (int)geom.vertex.size();
+        geom.vertex.push_back(sharedVertices[index]);
+        remap[index] = localIndex;
+        return localIndex;
+      };
+
+      for (auto &idx : geom.index) {
+        idx = int3(local(idx.x),local(idx.y),local(idx.z));
+      }
+    }
+
+    // ANARI memory deleter; drops one reference to the file mapping
+    static void releaseMapping(const void *userPtr, const void * /*appMemory*/)
+    {
+      delete (std::shared_ptr<FileMapping> *)userPtr;
+    }
+
+    void printStats(const std::vector<unsigned> &myClusters,
+                    size_t myNumTriangles,
+                    int commRank) {
+      std::stringstream s;
+      s << "Clusters assigned to (commRank): ("
+        << commRank << ")\n\t";
+      for (size_t i=0; i<myClusters.size(); ++i) {
+        s << myClusters[i];
+        if (i < myClusters.size()-1)
+          s << ", ";
+        else
+          s << '\n';
+      }
+      s << "\t# clusters on (" << commRank << "): "
+        << myClusters.size() << '\n';
+      s << "\t# triangles on (" << commRank << "): "
+        << prettyNumber(myNumTriangles) << '\n';
+      std::cout << s.str();
+    }
+
     /*! return a nicely formatted number as in "3.4M" instead of
         "3400000", etc, using mulitples of thousands (K), millions
         (M), etc. Ie, the value 64000 would be returned as 64K, and
@@ -185,5 +609,27 @@ namespace util {
       return buf;
     }
 
+    Mode mode;
+
+    Partitioner::Strategy strategy;
+
+    // Clusters of the most recently loaded file; the partitioner
+    // keeps a reference to these
+    std::vector<Cluster> clusters;
+
+    // Triangle counts of these clusters
+    std::vector<uint64_t> clusterTriangles;
+
+    // Clusters held by this rank, in the order of the geoms of
+    // the mesh returned by load()
+    std::vector<unsigned> loadedClusters;
+
+    // Cluster-to-rank assignment of the most recently loaded file;
+    // can also be used to compute a visibility-ordered composite
+    // order (Partitioner::computeCompositeOrder())
+    std::shared_ptr<Partitioner> partitioner;
+
+    // Duplicate of MPI_COMM_WORLD, created by the first rebalance()
+    MPI_Comm migrationComm = MPI_COMM_NULL;
   };
 } // util
@@ -0,0 +1,545 @@
+#pragma once
+
+// std
+#include <atomic>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <vector>
+// anari
+#include "anari/anari_cpp.hpp" // ours
+#include "MPIFileReader.h"
+#include "Partitioner.h"
+#include "ThreadPool.h"
+#include "VolFile.h"
+#include "volume.h"
+
+namespace util {
+
+  using int3 = anari::math::int3;
+
+  // A brick of a partitioned volume, voxels converted to
+  // normalized floats
+  struct VolumeBrick {
+    typedef std::shared_ptr<VolumeBrick> SP;
+
+    // brick id in the .vols file
+    unsigned id;
+    box3i cellRange;
+    box3i voxelRange;
+    box3 spaceRange;
+    box1 valueRange;
+    std::vector<float> voxels;
+
+    // Value ranges of blocks of macrocellSize^3 cells, for empty
+    // space skipping; empty if the file has no macrocells
+    int macrocellSize = 0;
+    int3 macrocellDims{0};
+    std::vector<box1> macrocells;
+
+    const box1 &macrocell(int3 mc) const
+    { return macrocells[(mc.z*size_t(macrocellDims.y)+mc.y)*macrocellDims.x+mc.x]; }
+
+    // Voxels of the brick's spatial field: its cells plus the
+    // neighbors' first voxel layer. Ghost layers are left out,
+    // fields of neighboring bricks would overlap otherwise
+    box3i fieldVoxelRange() const {
+      return { cellRange.lower, min(cellRange.upper+int3(1),voxelRange.upper) };
+    }
+
+    // Voxels (in volume coordinates) covered by a macrocell
+    box3i macrocellVoxelRange(int3 mc) const {
+      box3i res;
+      res.lower = voxelRange.lower+mc*int3(macrocellSize);
+      res.upper = min(res.lower+int3(macrocellSize+1),voxelRange.upper);
+      return res;
+    }
+  };
+
+  // Opacity table of a transferFunction1D volume, spread
+  // evenly over its value domain and linearly interpolated
+  struct TransferFunction {
+    std::vector<float> opacity;
+    // empty: the value range of the whole volume
+    box1 valueRange{1e30f,-1e30f};
+
+    // True if all values in 'values' map to zero opacity
+    bool transparent(box1 values, box1 volumeRange) const {
+      if (opacity.empty() || values.lower > values.upper)
+        return opacity.size() > 0;
+
+      box1 domain = valueRange.lower <= valueRange.upper ? valueRange : volumeRange;
+      int n = (int)opacity.size();
+      int first = 0, last = n-1;
+      if (domain.upper > domain.lower) {
+        float scale = (n-1)/(domain.upper-domain.lower);
+        float lo = (values.lower-domain.lower)*scale;
+        float hi = (values.upper-domain.lower)*scale;
+        first = std::max(0,std::min(n-1,(int)floorf(lo)));
+        last = std::max(0,std::min(n-1,(int)ceilf(hi)));
+      }
+
+      for (int i=first; i<=last; ++i) {
+        if (opacity[i] > 0.f)
+          return false;
+      }
+      return true;
+    }
+  };
+
+  struct BrickedVolume {
+    typedef std::shared_ptr<BrickedVolume> SP;
+
+    // bounds and value range of the *whole* volume
+    box3 bounds;
+    box1 valueRange;
+    // voxel layers around the bricks' cell ranges, in
+    // addition to the neighbors' first layer
+    int ghostWidth;
+    // this rank's bricks
+    std::vector<VolumeBrick::SP> bricks;
+  };
+
+  // ======================================================
+  // Given a rank, comm-size and .vols file name loads
+  // the bricks of the volume assigned to this process
+  // ======================================================
+  struct PartitionedVolumeLoader
+  {
+    // Stream: read the assigned bricks with std::ifstream
+    // MPIIO:  read collectively through MPI-IO; all ranks of
+    //         MPI_COMM_WORLD must call load()
+    enum class Mode { Stream, MPIIO, };
+
+    PartitionedVolumeLoader(Mode mode = Mode::Stream,
+                            Partitioner::Strategy strategy = Partitioner::Strategy::KD)
+      : mode(mode)
+      , strategy(strategy)
+    {}
+
+    BrickedVolume::SP load(std::string fileName, int commRank, int commSize) {
+      if (mode == Mode::MPIIO)
+        return loadMPIIO(fileName, commRank, commSize);
+
+      std::ifstream ifs(fileName,std::ios::binary);
+      if (!ifs.good()) {
+        std::cerr << "cannot open file: " << fileName << '\n';
+        return nullptr;
+      }
+
+      VolFile vol;
+      bool ok = vol.readHeader([&](uint64_t offset, void *dst, size_t len) {
+        ifs.seekg(offset);
+        ifs.read((char *)dst,len);
+        return ifs.good();
+      });
+      if (!ok) {
+        std::cerr << "cannot read header of file: " << fileName << '\n';
+        return nullptr;
+      }
+
+      this->fileName = fileName;
+      BrickedVolume::SP volume = makeVolume(vol, commRank, commSize);
+
+      if (!readBricks(ifs,volume->bricks))
+        return nullptr;
+
+      printStats(volume,commRank);
+
+      return volume;
+    }
+
+    // ====================================================
+    // Collective variant of load(): the headers are read
+    // with MPI_File_read_at_all, then each rank reads all of
+    // its bricks with a single file view
+    // ====================================================
+    BrickedVolume::SP loadMPIIO(std::string fileName, int commRank, int commSize) {
+      std::unique_ptr<MPIFileReader> reader;
+      try {
+        reader.reset(new MPIFileReader(fileName, MPI_COMM_WORLD));
+      } catch (...) {
+        std::cerr << "cannot open file: " << fileName << '\n';
+        return nullptr;
+      }
+
+      VolFile vol;
+      bool ok = vol.readHeader([&](uint64_t offset, void *dst, size_t len) {
+        return reader->readAt(offset,dst,len);
+      });
+      if (!ok) {
+        std::cerr << "cannot read header of file: " << fileName << '\n';
+        return nullptr;
+      }
+
+      this->fileName = fileName;
+      BrickedVolume::SP volume = makeVolume(vol, commRank, commSize);
+
+      if (!readBricks(*reader,volume->bricks))
+        return nullptr;
+
+      printStats(volume,commRank);
+
+      return volume;
+    }
+
+    // ====================================================
+    // Change the transfer function after loading: bricks
+    // that were culled and are now visible are read and
+    // appended to the volume's bricks. Returns the newly
+    // loaded bricks. Bricks that became transparent stay
+    // loaded. Collective in MPIIO mode
+    // ====================================================
+    std::vector<VolumeBrick::SP> setTransferFunction(const TransferFunction &tf) {
+      transferFunction = tf;
+
+      std::vector<VolumeBrick::SP> visible;
+      if (!volume)
+        return visible;
+
+      std::vector<VolumeBrick::SP> stillCulled;
+      for (auto &brick : culledBricks) {
+        if (transparent(vol.bricks[brick->id])) {
+          stillCulled.push_back(brick);
+        } else {
+          brick->voxels.resize(vol.bricks[brick->id].numVoxels());
+          visible.push_back(brick);
+        }
+      }
+
+      bool ok = false;
+      if (mode == Mode::MPIIO) {
+        try {
+          MPIFileReader reader(fileName, MPI_COMM_WORLD);
+          ok = readBricks(reader,visible);
+        } catch (...) {
+          std::cerr << "cannot open file: " << fileName << '\n';
+        }
+      } else if (!visible.empty()) {
+        std::ifstream ifs(fileName,std::ios::binary);
+        ok = readBricks(ifs,visible);
+      } else {
+        ok = true;
+      }
+
+      if (!ok) {
+        for (auto &brick : visible)
+          brick->voxels = std::vector<float>();
+        return {};
+      }
+
+      culledBricks = stillCulled;
+      for (auto &brick : visible) {
+        volume->bricks.push_back(brick);
+        loadedBricks.push_back(brick->id);
+        bytesSkipped -= vol.bricks[brick->id].storedBytes;
+      }
+
+      return visible;
+    }
+
+    // ====================================================
+    // Create one structuredRegular spatial field per brick.
+    // The fields are placed in world space by their voxel
+    // range, so the bricks' shared voxel layers line up;
+    // the voxel arrays are handed over to ANARI (no copy).
+    // ANARI renders a field's whole extent, so files with
+    // ghost layers are cropped to fieldVoxelRange() (copy)
+    // ====================================================
+    std::vector<anari::SpatialField> loadANARI(anari::Device device,
+                                               std::string fileName,
+                                               int commRank,
+                                               int commSize,
+                                               box3 *bounds=NULL,
+                                               box1 *valueRange=NULL) {
+      std::vector<anari::SpatialField> res;
+      auto volume = load(fileName, commRank, commSize);
+      if (!volume)
+        return res;
+
+      for (auto &brick : volume->bricks) {
+        res.push_back(makeField(device, *brick));
+      }
+
+      if (bounds) {
+        *bounds = volume->bounds;
+      }
+
+      if (valueRange) {
+        *valueRange = volume->valueRange;
+      }
+
+      return res;
+    }
+
+    // Like setTransferFunction(), returning spatial fields for
+    // the newly loaded bricks
+    std::vector<anari::SpatialField> setTransferFunctionANARI(anari::Device device,
+                                                              const TransferFunction &tf) {
+      std::vector<anari::SpatialField> res;
+      for (auto &brick : setTransferFunction(tf)) {
+        res.push_back(makeField(device, *brick));
+      }
+      return res;
+    }
+
+    // ====================================================
+    // Bounds of the region owned by commRank (valid after
+    // loading); meant to be set as the world's "region".
+    // These are the bricks' cell ranges, so the shared
+    // voxel layers aren't rendered twice
+    // ====================================================
+    box3 regionBounds(int commRank) const {
+      if (!partitioner)
+        return { float3(1e30f), float3(-1e30f) };
+      return partitioner->regionBounds(commRank);
+    }
+
+    Mode mode;
+    Partitioner::Strategy strategy;
+
+    // threads used to decode the bricks; 0: hardware concurrency
+    unsigned numThreads = 0;
+
+    // Bricks that are fully transparent under this transfer
+    // function aren't loaded (see setTransferFunction())
+    TransferFunction transferFunction;
+
+    // bricks as partitioner input
+    std::vector<Cluster> clusters;
+
+    // IDs of the bricks loaded on this rank
+    std::vector<unsigned> loadedBricks;
+
+    // Bricks assigned to this rank, but not loaded because
+    // they're transparent, and the file bytes that saves
+    std::vector<VolumeBrick::SP> culledBricks;
+    uint64_t bytesSkipped = 0;
+
+    std::shared_ptr<Partitioner> partitioner;
+
+   private:
+    std::string fileName;
+    VolFile vol;
+    BrickedVolume::SP volume;
+
+    static void releaseVoxels(const void *userPtr, const void *) {
+      delete (std::vector<float> *)userPtr;
+    }
+
+    // See loadANARI()
+    static anari::SpatialField makeField(anari::Device device, VolumeBrick &brick) {
+      auto field = anari::newObject<anari::SpatialField>(device, "structuredRegular");
+
+      box3i range = brick.fieldVoxelRange();
+      int3 dims = range.upper-range.lower;
+      auto *voxels = new std::vector<float>;
+      if (range.lower == brick.voxelRange.lower
+       && range.upper == brick.voxelRange.upper) {
+        voxels->swap(brick.voxels);
+      } else {
+        int3 brickDims = brick.voxelRange.upper-brick.voxelRange.lower;
+        int3 offset = range.lower-brick.voxelRange.lower;
+        voxels->resize(size_t(dims.x)*dims.y*dims.z);
+        for (int z=0; z<dims.z; ++z) {
+          for (int y=0; y<dims.y; ++y) {
+            size_t src = ((size_t(z+offset.z)*brickDims.y)+y+offset.y)*brickDims.x
+                + offset.x;
+            size_t dst = (size_t(z)*dims.y+y)*dims.x;
+            memcpy(voxels->data()+dst,brick.voxels.data()+src,dims.x*sizeof(float));
+          }
+        }
+        brick.voxels = std::vector<float>();
+      }
+      auto data = anari::newArray3D(device,
+                                    voxels->data(),
+                                    releaseVoxels,
+                                    voxels,
+                                    dims.x,dims.y,dims.z);
+      anari::setAndReleaseParameter(device, field, "data", data);
+      anari::setParameter(device, field, "origin", float3(range.lower));
+      anari::setParameter(device, field, "spacing", float3(1.f));
+      anari::commitParameters(device, field);
+      return field;
+    }
+
+    // A brick is transparent if all its macrocells (or, without
+    // macrocells, its value range) map to zero opacity
+    bool transparent(const VolFile::Brick &b) const {
+      if (b.macrocells.empty())
+        return transferFunction.transparent(b.valueRange,vol.valueRange);
+
+      for (const box1 &mc : b.macrocells) {
+        if (!transferFunction.transparent(mc,vol.valueRange))
+          return false;
+      }
+      return true;
+    }
+
+    bool readBricks(std::istream &is, const std::vector<VolumeBrick::SP> &bricks) {
+      std::vector<std::vector<uint8_t>> stored(bricks.size());
+      for (size_t i=0; i<bricks.size(); ++i) {
+        const VolFile::Brick &b = vol.bricks[bricks[i]->id];
+        is.seekg(b.voxelOffset);
+        is.read((char *)stagingBuffer(b,*bricks[i],stored[i]),b.storedBytes);
+      }
+
+      if (!is.good()) {
+        std::cerr << "cannot read bricks from file: " << fileName << '\n';
+        return false;
+      }
+
+      return decode(bricks,stored);
+    }
+
+    // Collective
+    bool readBricks(MPIFileReader &reader, const std::vector<VolumeBrick::SP> &bricks) {
+      std::vector<std::vector<uint8_t>> stored(bricks.size());
+      std::vector<MPIFileReader::Extent> extents;
+      for (size_t i=0; i<bricks.size(); ++i) {
+        const VolFile::Brick &b = vol.bricks[bricks[i]->id];
+        extents.push_back({b.voxelOffset,
+                           b.storedBytes,
+                           stagingBuffer(b,*bricks[i],stored[i])});
+      }
+
+      if (!reader.readAll(extents)) {
+        std::cerr << "cannot read bricks from file: " << fileName << '\n';
+        return false;
+      }
+
+      return decode(bricks,stored);
+    }
+
+    // Uncompressed float bricks are read straight into the brick's
+    // voxels, everything else into a staging buffer for decode()
+    static bool readsDirectly(const VolFile::Brick &b) {
+      return b.codec == BrickCodec::None && b.bpc == sizeof(float);
+    }
+
+    static void *stagingBuffer(const VolFile::Brick &b,
+                               VolumeBrick &brick,
+                               std::vector<uint8_t> &stored) {
+      if (readsDirectly(b))
+        return brick.voxels.data();
+      stored.resize(b.storedBytes);
+      return stored.data();
+    }
+
+    // Decode the staged bricks and convert them to normalized floats,
+    // one task per brick
+    bool decode(const std::vector<VolumeBrick::SP> &bricks,
+                const std::vector<std::vector<uint8_t>> &stored) {
+      ThreadPool pool(numThreads > 0 ? numThreads
+                                     : std::thread::hardware_concurrency());
+      std::atomic<bool> ok{true};
+      ThreadPool::TaskGroup group;
+      for (size_t i=0; i<bricks.size(); ++i) {
+        const VolFile::Brick &b = vol.bricks[bricks[i]->id];
+        if (readsDirectly(b))
+          continue;
+
+        pool.spawn(group, [&,i]() {
+          VolumeBrick &brick = *bricks[i];
+          const VolFile::Brick &b = vol.bricks[brick.id];
+          std::vector<uint8_t> voxels(b.numBytes());
+          if (!decodeBrick(b.codec,b.bpc,stored[i].data(),b.storedBytes,
+                           voxels.data(),voxels.size())
+           || !Volume::toFloat(voxels.data(),b.bpc,brick.voxels.data(),
+                               brick.voxels.size()))
+            ok = false;
+        });
+      }
+      pool.wait(group);
+
+      if (!ok)
+        std::cerr << "cannot decode bricks from file: " << fileName << '\n';
+      return ok;
+    }
+
+    void partition(const VolFile &vol, int commSize) {
+      clusters.resize(vol.bricks.size());
+      for (unsigned i=0; i<vol.bricks.size(); ++i) {
+        clusters[i] = {
+          (int)i, // brickID
+          -1, // rankID; we don't know this yet
+          vol.bricks[i].spaceRange,
+          (float)vol.bricks[i].numVoxels() // cost
+        };
+      }
+
+      partitioner = std::make_shared<Partitioner>(clusters,commSize);
+      partitioner->partition(strategy);
+    }
+
+    // Partition and allocate this rank's bricks
+    BrickedVolume::SP makeVolume(const VolFile &vol, int commRank, int commSize) {
+      this->vol = vol;
+      partition(vol,commSize);
+
+      volume = std::make_shared<BrickedVolume>();
+      volume->bounds = vol.spaceRange;
+      volume->valueRange = vol.valueRange;
+      volume->ghostWidth = vol.ghostWidth;
+
+      loadedBricks.clear();
+      culledBricks.clear();
+      bytesSkipped = 0;
+      for (unsigned i=0; i<vol.bricks.size(); ++i) {
+        if (!partitioner->assignedTo(i,commRank))
+          continue;
+
+        const VolFile::Brick &b = vol.bricks[i];
+        VolumeBrick::SP brick = std::make_shared<VolumeBrick>();
+        brick->id = i;
+        brick->cellRange = b.cellRange;
+        brick->voxelRange = b.voxelRange;
+        brick->spaceRange = b.spaceRange;
+        brick->valueRange = b.valueRange;
+        if (vol.macrocellSize > 0) {
+          brick->macrocellSize = vol.macrocellSize;
+          brick->macrocellDims = macrocellDims(b.dims(),vol.macrocellSize);
+          brick->macrocells = b.macrocells;
+        }
+        if (transparent(b)) {
+          culledBricks.push_back(brick);
+          bytesSkipped += b.storedBytes;
+          continue;
+        }
+        brick->voxels.resize(b.numVoxels());
+        volume->bricks.push_back(brick);
+        loadedBricks.push_back(i);
+      }
+
+      return volume;
+    }
+
+    void printStats(const BrickedVolume::SP &volume, int commRank) {
+      size_t myNumVoxels = 0;
+      std::stringstream s;
+      s << "Bricks assigned to (commRank): ("
+        << commRank << ")\n\t";
+      for (size_t i=0; i<volume->bricks.size(); ++i) {
+        s << volume->bricks[i]->id;
+        if (i < volume->bricks.size()-1)
+          s << ", ";
+        else
+          s << '\n';
+        myNumVoxels += volume->bricks[i]->voxels.size();
+      }
+      s << "\t# bricks on (" << commRank << "): "
+        << volume->bricks.size() << '\n';
+      s << "\t# voxels on (" << commRank << "): "
+        << myNumVoxels << '\n';
+      if (!culledBricks.empty()) {
+        s << "\t# transparent bricks skipped on (" << commRank << "): "
+          << culledBricks.size() << " (" << bytesSkipped << " bytes)\n";
+      }
+      std::cout << s.str();
+    }
+  };
+
+} // util
@@ -1,7 +1,11 @@
 #pragma once
 
 // std
+#include <assert.h>
+#include <float.h>
 #include <limits.h>
+#include <math.h>
+#include <algorithm>
 #include <iostream>
 #include <numeric>
 #include <vector>
@@ -25,6 +29,10 @@ namespace util {
 
     // domain bounds; those won't overlap
     box3 domain;
+
+    // estimated cost to render this cluster (e.g., triangle
+    // count, voxel count, or measured render time)
+    float cost = 1.f;
   };
 
   // ==================================================================
@@ -33,6 +41,14 @@ namespace util {
 
   struct Partitioner
   {
+    enum class Strategy { RoundRobin, KD, WeightedKD, };
+
+    struct KDNode {
+      int splitAxis;
+      float splitPlane;
+      int child1,child2;
+    };
+
     Partitioner(std::vector<Cluster> &clusters, int numRanks)
       : input(clusters)
       , numRanks(numRanks)
@@ -42,6 +58,20 @@ namespace util {
       perRank.resize(numRanks);
     }
 
+    void partition(Strategy strategy)
+    {
+      kdTree.clear();
+      for (auto &pr : perRank)
+        pr.clear();
+
+      if (strategy == Strategy::KD)
+        partitionKD();
+      else if (strategy == Strategy::WeightedKD)
+        partitionWeightedKD();
+      else
+        partitionRoundRobin();
+    }
+
     void partitionRoundRobin()
     {
       auto div_up = [](int a, int b) { return (a+b-1)/b; };
@@ -58,124 +88,193 @@ namespace util {
 
     void partitionKD()
     {
-      // Assign same number of clusters per rank; use split-middle heuristic
-      int numClustersPerRank = input.size()/numRanks;
+      // Assign same number of clusters per rank: recursively split
+      // the rank range in two and place the split plane such that
+      // the number of clusters on either side is proportional to
+      // the number of ranks on that side
+      std::vector<int> clusterIDs(input.size());
+      for (size_t i=0; i<input.size(); ++i)
+        clusterIDs[i] = input[i].id;
 
-      struct Clusters {
-        box3 bounds;
-        std::vector<int> clusterIDs;
-        int kdNodeID;
-      };
+      kdTree.emplace_back(KDNode{0,0.f,INT_MAX,INT_MAX});
+      splitKD(clusterIDs,0,numRanks,0,false);
+    }
 
-      Clusters all;
-      all.bounds = { float3(1e30f), float3(-1e30f) };
-      for (size_t i=0; i<input.size(); ++i)
-      {
-        all.bounds.extend(input[i].domain);
-        all.clusterIDs.push_back(input[i].id);
-        all.kdNodeID = 0;
+    // Produces exactly one leaf per rank (ranks that don't get any
+    // clusters own an empty region)
+    void splitKD(const std::vector<int> &clusterIDs,
+                 int firstRank,
+                 int rankCount,
+                 int kdNodeID,
+                 bool weighted)
+    {
+      if (rankCount == 1) {
+        kdTree[kdNodeID].child1 = ~firstRank;
+        kdTree[kdNodeID].child2 = ~firstRank;
+        for (auto id : clusterIDs) {
+          input[id].rank = firstRank;
+          perRank[firstRank].push_back(id);
+        }
+        return;
       }
 
-      std::vector<Clusters> clusters;
-      std::vector<Clusters> assignedClusters;
+      int numRanksL = rankCount/2;
 
-      clusters.push_back(all);
+      KDNode split = findSplit(clusterIDs,double(numRanksL)/rankCount,weighted);
+
+      std::vector<int> L, R;
+      for (auto id : clusterIDs) {
+        if (input[id].domain.center()[split.splitAxis] < split.splitPlane)
+          L.push_back(id);
+        else
+          R.push_back(id);
+      }
 
+      kdTree[kdNodeID].splitAxis = split.splitAxis;
+      kdTree[kdNodeID].splitPlane = split.splitPlane;
+
+      int child1 = kdTree.size();
+      kdTree[kdNodeID].child1 = child1;
       kdTree.emplace_back(KDNode{0,0.f,INT_MAX,INT_MAX});
 
-      while (!clusters.empty()) {
-        unsigned clusterToPick = 0;
+      int child2 = kdTree.size();
+      kdTree[kdNodeID].child2 = child2;
+      kdTree.emplace_back(KDNode{0,0.f,INT_MAX,INT_MAX});
 
-        // Pick cluster with most clusters
-        int maxNumIDs = 0;
-        for (unsigned i=0; i<clusters.size(); ++i)
-        {
-          if (clusters[i].clusterIDs.size() > maxNumIDs) {
-            clusterToPick = i;
-            maxNumIDs = clusters[i].clusterIDs.size();
-          }
-        }
+      splitKD(L,firstRank,numRanksL,child1,weighted);
+      splitKD(R,firstRank+numRanksL,rankCount-numRanksL,child2,weighted);
+    }
 
-        Clusters cs = clusters[clusterToPick];
-        clusters.erase(clusters.begin()+clusterToPick);
-
-        if (cs.clusterIDs.size() <= numClustersPerRank
-         || assignedClusters.size() == numRanks-1) {
-          int rankID = assignedClusters.size();
-          kdTree[cs.kdNodeID].child1 = ~rankID;
-          kdTree[cs.kdNodeID].child2 = ~rankID;
-          assignedClusters.push_back(cs);
-
-          if (assignedClusters.size() == numRanks) {
-            // Bump all remaining clusters into the last one
-            Clusters& last = assignedClusters.back();
-            while (!clusters.empty()) {
-              Clusters cs = clusters[0];
-              for (auto id : cs.clusterIDs) {
-                last.clusterIDs.push_back(id);
-              }
-              clusters.erase(clusters.begin());
-            }
-            break;
-          }
-          else
+    // Split plane that puts fractionL of the clusters' cost (or count,
+    // if !weighted) on the left. Only planes that no cluster domain
+    // straddles are considered, so the two sides' regions don't
+    // overlap; the domains of a kd-tree (as written by chopSuey)
+    // always have one
+    KDNode findSplit(const std::vector<int> &clusterIDs,
+                     double fractionL,
+                     bool weighted) const
+    {
+      auto cost = [&](int id) { return weighted ? (double)input[id].cost : 1.0; };
+
+      // Nothing to split, all clusters go to the left
+      KDNode res{0,1e30f,INT_MAX,INT_MAX};
+      if (clusterIDs.size() < 2)
+        return res;
+
+      box3 bounds = { float3(1e30f), float3(-1e30f) };
+      double totalCost = 0.0;
+      for (auto id : clusterIDs) {
+        bounds.extend(input[id].domain);
+        totalCost += cost(id);
+      }
+
+      // Cost per rank on the more expensive side
+      auto imbalance = [&](double costL) {
+        return std::max(costL/fractionL,(totalCost-costL)/(1.0-fractionL));
+      };
+
+      // Try the axes from largest to smallest extent; on ties, the
+      // first one wins
+      int axes[3] = {0,1,2};
+      std::stable_sort(axes,axes+3,[&](int a, int b) {
+        return bounds.size()[a] > bounds.size()[b];
+      });
+
+      double bestDiff = DBL_MAX;
+      std::vector<int> ids = clusterIDs;
+      for (int axis : axes) {
+        std::sort(ids.begin(),ids.end(),[&](int a, int b) {
+          return input[a].domain.lower[axis] < input[b].domain.lower[axis];
+        });
+
+        // Candidate planes are the domains' lower boundaries; all the
+        // domains before the plane have to end there
+        double prefixCost = 0.0;
+        float maxUpper = -1e30f;
+        for (size_t i=1; i<ids.size(); ++i) {
+          prefixCost += cost(ids[i-1]);
+          maxUpper = fmaxf(maxUpper,input[ids[i-1]].domain.upper[axis]);
+          float plane = input[ids[i]].domain.lower[axis];
+          if (plane <= input[ids[i-1]].domain.lower[axis] || maxUpper > plane)
             continue;
+          double diff = imbalance(prefixCost);
+          if (diff < bestDiff) {
+            bestDiff = diff;
+            res.splitAxis = axis;
+            res.splitPlane = plane;
+          }
         }
+      }
 
-        int splitAxis = 0;
-        if (cs.bounds.size()[1]>cs.bounds.size()[0]
-         && cs.bounds.size()[1]>=cs.bounds.size()[2]) {
-          splitAxis = 1;
-        } else if (cs.bounds.size()[2]>cs.bounds.size()[0]
-                && cs.bounds.size()[2]>=cs.bounds.size()[1]) {
-          splitAxis = 2;
+      if (bestDiff < DBL_MAX)
+        return res;
+
+      // No separating plane: split at the centroids, the regions
+      // will overlap (see regionsOverlap())
+      int axis = axes[0];
+      std::sort(ids.begin(),ids.end(),[&](int a, int b) {
+        return input[a].domain.center()[axis] < input[b].domain.center()[axis];
+      });
+
+      size_t splitIndex = 1;
+      double prefixCost = cost(ids[0]);
+      bestDiff = imbalance(prefixCost);
+      for (size_t i=1; i<ids.size()-1; ++i) {
+        prefixCost += cost(ids[i]);
+        double diff = imbalance(prefixCost);
+        if (diff < bestDiff) {
+          bestDiff = diff;
+          splitIndex = i+1;
         }
+      }
 
-        // Middle split
-        float splitPlane = cs.bounds.lower[splitAxis]+cs.bounds.size()[splitAxis]*.5f;
-
-        Clusters L,R;
-        L.bounds = { float3(1e30f), float3(-1e30f) };
-        R.bounds = { float3(1e30f), float3(-1e30f) };
-        for (size_t i=0; i<cs.clusterIDs.size(); ++i) {
-          int clusterID = cs.clusterIDs[i];
-          Cluster c = input[clusterID];
-          float3 centroid = c.domain.center();
-          if (centroid[splitAxis] < splitPlane) {
-            L.bounds.extend(c.domain);
-            L.clusterIDs.push_back(clusterID);
-          } else {
-            R.bounds.extend(c.domain);
-            R.clusterIDs.push_back(clusterID);
-          }
-        }
+      res.splitAxis = axis;
+      res.splitPlane = input[ids[splitIndex]].domain.center()[axis];
+      return res;
+    }
 
-        kdTree[cs.kdNodeID].splitAxis = splitAxis;
-        kdTree[cs.kdNodeID].splitPlane = splitPlane;
+    void partitionWeightedKD()
+    {
+      // Like partitionKD(), but the cumulative cluster cost on either
+      // side of a split matches the number of ranks on that side
+      std::vector<int> clusterIDs(input.size());
+      for (size_t i=0; i<input.size(); ++i)
+        clusterIDs[i] = input[i].id;
 
-        L.kdNodeID = kdTree.size();
-        kdTree[cs.kdNodeID].child1 = L.kdNodeID;
-        kdTree.emplace_back(KDNode{0,0.f,INT_MAX,INT_MAX});
-        clusters.push_back(L);
+      kdTree.emplace_back(KDNode{0,0.f,INT_MAX,INT_MAX});
+      splitKD(clusterIDs,0,numRanks,0,true);
+    }
 
-        R.kdNodeID = kdTree.size();
-        kdTree[cs.kdNodeID].child2 = R.kdNodeID;
-        kdTree.emplace_back(KDNode{0,0.f,INT_MAX,INT_MAX});
-        clusters.push_back(R);
-      }
+    struct Stats {
+      float minCost, maxCost, avgCost;
+      // maxCost/avgCost; 1 is perfectly balanced
+      float imbalance;
+    };
 
-      for (size_t i=0; i<assignedClusters.size(); ++i) {
-        for (size_t j=0; j<assignedClusters[i].clusterIDs.size(); ++j) {
-          perRank[i].push_back(assignedClusters[i].clusterIDs[j]);
-        }
+    // Per-rank cost statistics of the current assignment
+    Stats computeStats() const
+    {
+      Stats stats{FLT_MAX,0.f,0.f,1.f};
+      for (int r=0; r<numRanks; ++r) {
+        float cost = 0.f;
+        for (auto id : perRank[r])
+          cost += input[id].cost;
+        stats.minCost = fminf(stats.minCost,cost);
+        stats.maxCost = fmaxf(stats.maxCost,cost);
+        stats.avgCost += cost;
       }
+      stats.avgCost /= numRanks;
+      if (stats.avgCost > 0.f)
+        stats.imbalance = stats.maxCost/stats.avgCost;
+      return stats;
+    }
 
-      // for (auto kd : kdTree) {
-      //   std::cout << kd.splitAxis << ','
-      //             << kd.splitPlane << ','
-      //             << kd.child1 << ','
-      //             << kd.child2 << '\n';
-      // }
+    void printStats(std::ostream &out = std::cout) const
+    {
+      Stats stats = computeStats();
+      out << "Partition cost (min/avg/max): "
+          << stats.minCost << '/' << stats.avgCost << '/' << stats.maxCost
+          << ", imbalance (max/avg): " << stats.imbalance << '\n';
     }
 
     bool assignedTo(int clusterID, int rankID)
@@ -187,6 +286,36 @@ namespace util {
       return false;
     }
 
+    // Bounds of all the clusters assigned to rankID
+    box3 regionBounds(int rankID) const
+    {
+      box3 bounds = { float3(1e30f), float3(-1e30f) };
+      for (size_t i=0; i<perRank[rankID].size(); ++i) {
+        bounds.extend(input[perRank[rankID][i]].domain);
+      }
+      return bounds;
+    }
+
+    // Whether the regions of two different ranks overlap (sharing
+    // a face is fine); if so, there's no valid composite order
+    bool regionsOverlap() const
+    {
+      for (int r1=0; r1<numRanks; ++r1) {
+        box3 b1 = regionBounds(r1);
+        for (int r2=r1+1; r2<numRanks; ++r2) {
+          box3 b2 = regionBounds(r2);
+          bool overlap = true;
+          for (int a=0; a<3; ++a) {
+            if (b1.upper[a] <= b2.lower[a] || b2.upper[a] <= b1.lower[a])
+              overlap = false;
+          }
+          if (overlap)
+            return true;
+        }
+      }
+      return false;
+    }
+
     void computeCompositeOrder(const float3 &reference)
     {
       if (kdTree.empty()) {
@@ -224,12 +353,6 @@ namespace util {
       }
     }
 
-    struct KDNode {
-      int splitAxis;
-      float splitPlane;
-      int child1,child2;
-    };
-
     // KD tree to sort clusters into visibility order
     std::vector<KDNode> kdTree;
 
@@ -0,0 +1,193 @@
+#pragma once
+
+// std
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace util {
+
+  // ==================================================================
+  // Work-stealing thread pool. Each thread owns a task deque; it pops
+  // from the back of its own deque and steals from the front of the
+  // others. Tasks may spawn more tasks; wait() executes tasks itself
+  // until the group is done, so nested waits don't deadlock. With a
+  // single thread, all tasks run on the thread calling wait(). If
+  // tasks throw, wait() rethrows the first exception once the group
+  // is done
+  // ==================================================================
+
+  struct ThreadPool
+  {
+    struct TaskGroup {
+      std::atomic<size_t> pending{0};
+      std::mutex errorMutex;
+      std::exception_ptr error;
+    };
+
+    // numThreads includes the thread calling wait()
+    ThreadPool(unsigned numThreads = std::thread::hardware_concurrency())
+    {
+      numThreads = numThreads > 0 ? numThreads : 1;
+      for (unsigned i=0; i<numThreads; ++i)
+        queues.emplace_back(new Queue);
+
+      for (unsigned i=1; i<numThreads; ++i) {
+        workers.emplace_back([this,i]() {
+          owner() = {this,(int)i};
+          while (true) {
+            if (runOne(i))
+              continue;
+            std::unique_lock<std::mutex> l(sleepMutex);
+            sleepCond.wait(l, [this]() { return stop || numQueued > 0; });
+            if (stop)
+              return;
+          }
+        });
+      }
+    }
+
+    ~ThreadPool()
+    {
+      {
+        std::lock_guard<std::mutex> l(sleepMutex);
+        stop = true;
+      }
+      sleepCond.notify_all();
+      for (auto &w : workers)
+        w.join();
+    }
+
+    unsigned size() const
+    { return (unsigned)queues.size(); }
+
+    void spawn(TaskGroup &group, std::function<void()> task)
+    {
+      group.pending++;
+      Queue &q = *queues[myQueue()];
+      {
+        std::lock_guard<std::mutex> l(q.mutex);
+        q.tasks.push_back({std::move(task),&group});
+      }
+      {
+        std::lock_guard<std::mutex> l(sleepMutex);
+        numQueued++;
+      }
+      sleepCond.notify_one();
+    }
+
+    void wait(TaskGroup &group)
+    {
+      unsigned self = myQueue();
+      while (group.pending > 0) {
+        if (!runOne(self))
+          std::this_thread::yield();
+      }
+
+      std::exception_ptr error;
+      {
+        std::lock_guard<std::mutex> l(group.errorMutex);
+        std::swap(error,group.error);
+      }
+      if (error)
+        std::rethrow_exception(error);
+    }
+
+    // Calls func(begin,end) on sub-ranges of at most grainSize items
+    template <typename Func>
+    void parallelFor(size_t begin, size_t end, size_t grainSize, Func func)
+    {
+      if (end-begin <= grainSize || size() == 1) {
+        func(begin,end);
+        return;
+      }
+
+      TaskGroup group;
+      for (size_t b=begin; b<end; b+=grainSize) {
+        size_t e = std::min(b+grainSize,end);
+        spawn(group, [=]() { func(b,e); });
+      }
+      wait(group);
+    }
+
+   private:
+    struct Task {
+      std::function<void()> func;
+      TaskGroup *group;
+    };
+
+    struct Queue {
+      std::mutex mutex;
+      std::deque<Task> tasks;
+    };
+
+    // The pool owning the calling thread, and the thread's queue; pools
+    // may be nested, e.g., a task of one pool running another pool
+    struct Owner {
+      const ThreadPool *pool;
+      int index;
+    };
+
+    static Owner &owner()
+    {
+      static thread_local Owner o{nullptr,-1};
+      return o;
+    }
+
+    // Threads not owned by this pool share queue 0
+    unsigned myQueue() const
+    { return owner().pool == this ? (unsigned)owner().index : 0; }
+
+    bool runOne(unsigned self)
+    {
+      Task task;
+      bool found = false;
+
+      // own queue first (LIFO), then steal (FIFO)
+      for (unsigned i=0; i<queues.size() && !found; ++i) {
+        Queue &q = *queues[(self+i)%queues.size()];
+        std::lock_guard<std::mutex> l(q.mutex);
+        if (q.tasks.empty())
+          continue;
+        if (i == 0) {
+          task = std::move(q.tasks.back());
+          q.tasks.pop_back();
+        } else {
+          task = std::move(q.tasks.front());
+          q.tasks.pop_front();
+        }
+        found = true;
+      }
+
+      if (!found)
+        return false;
+
+      numQueued--;
+      try {
+        task.func();
+      } catch (...) {
+        std::lock_guard<std::mutex> l(task.group->errorMutex);
+        if (!task.group->error)
+          task.group->error = std::current_exception();
+      }
+      task.group->pending--;
+      return true;
+    }
+
+    std::vector<std::unique_ptr<Queue>> queues;
+    std::vector<std::thread> workers;
+
+    std::mutex sleepMutex;
+    std::condition_variable sleepCond;
+    std::atomic<size_t> numQueued{0};
+    bool stop = false;
+  };
+
+} // util
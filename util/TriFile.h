@@ -0,0 +1,156 @@
+#pragma once
+
+// std
+#include <cstdint>
+#include <functional>
+#include <vector>
+// anari
+#include "anari/anari_cpp/ext/linalg.h"
+// ours
+#include "box3.h"
+
+namespace util {
+
+  using box3 = anari::math::box3;
+
+  // ======================================================
+  // On-disk layout of the .tri files written by chopSuey
+  //
+  // version 1 (legacy, no magic):
+  //   uint64 numClusters, box3 bounds,
+  //   uint64 numVerts, float3 vertex[numVerts],
+  //   per cluster: uint64 numIndices, box3 domain,
+  //                int3 index[numIndices]
+  //
+  // version 2:
+  //   uint64 magic, uint64 version,
+  //   uint64 numClusters, box3 bounds,
+  //   per cluster: uint64 numVerts, uint64 numIndices,
+  //                box3 domain, float3 vertex[numVerts],
+  //                int3 index[numIndices]
+  //   (indices are local to the cluster's vertex block)
+  //
+  // version 3:
+  //   uint64 magic, uint64 version,
+  //   uint64 numClusters, box3 bounds,
+  //   TriFileDirEntry directory[numClusters],
+  //   per cluster (at directory[i].offset):
+  //                float3 vertex[numVerts],
+  //                int3 index[numIndices]
+  //   The fixed-size directory can be read with a single
+  //   request, then each rank seeks to its own clusters
+  // ======================================================
+
+  static const uint64_t triFileMagic = 0x4952545945555343ull; // "CSUEYTRI"
+  static const uint64_t triFileVersion = 3;
+
+  // Cluster directory entry (version 3)
+  struct TriFileDirEntry {
+    // absolute byte offset of the cluster's vertices
+    uint64_t offset;
+    // size of the cluster's data (vertices+indices) in bytes
+    uint64_t numBytes;
+    uint64_t numVerts;
+    // number of triangles
+    uint64_t numIndices;
+    box3 domain;
+  };
+  static_assert(sizeof(TriFileDirEntry)==4*sizeof(uint64_t)+sizeof(box3),
+                "TriFileDirEntry must not be padded");
+
+  struct TriFile {
+    struct Cluster {
+      uint64_t numVerts;
+      uint64_t numIndices;
+      box3 domain;
+      // absolute byte offsets into the file
+      uint64_t vertexOffset;
+      uint64_t indexOffset;
+    };
+
+    uint64_t version = 0;
+    box3 bounds;
+    std::vector<Cluster> clusters;
+
+    // v1 only: clusters share one vertex array
+    bool sharedVertices() const
+    { return version < 2; }
+
+    // Positional read, so the header can be parsed from any
+    // backend (stream, file mapping, ...)
+    typedef std::function<bool(uint64_t offset, void *dst, size_t len)> ReadAt;
+
+    bool readHeader(const ReadAt &readAt) {
+      uint64_t pos = 0;
+      auto read = [&](void *dst, size_t len) {
+        if (!readAt(pos,dst,len))
+          return false;
+        pos += len;
+        return true;
+      };
+
+      uint64_t first, numClusters;
+      if (!read(&first,sizeof(first)))
+        return false;
+
+      if (first == triFileMagic) {
+        if (!read(&version,sizeof(version))
+         || !read(&numClusters,sizeof(numClusters)))
+          return false;
+        if (version != 2 && version != 3)
+          return false;
+      } else {
+        version = 1;
+        numClusters = first;
+      }
+
+      if (!read(&bounds,sizeof(bounds)))
+        return false;
+
+      clusters.resize(numClusters);
+
+      if (version == 1) {
+        uint64_t numVerts;
+        if (!read(&numVerts,sizeof(numVerts)))
+          return false;
+        uint64_t vertexOffset = pos;
+        pos += sizeof(anari::math::float3)*numVerts;
+        for (auto &c : clusters) {
+          c.numVerts = numVerts;
+          c.vertexOffset = vertexOffset;
+          if (!read(&c.numIndices,sizeof(c.numIndices))
+           || !read(&c.domain,sizeof(c.domain)))
+            return false;
+          c.indexOffset = pos;
+          pos += sizeof(anari::math::int3)*c.numIndices;
+        }
+      } else if (version == 2) {
+        for (auto &c : clusters) {
+          if (!read(&c.numVerts,sizeof(c.numVerts))
+           || !read(&c.numIndices,sizeof(c.numIndices))
+           || !read(&c.domain,sizeof(c.domain)))
+            return false;
+          c.vertexOffset = pos;
+          pos += sizeof(anari::math::float3)*c.numVerts;
+          c.indexOffset = pos;
+          pos += sizeof(anari::math::int3)*c.numIndices;
+        }
+      } else {
+        std::vector<TriFileDirEntry> directory(numClusters);
+        if (!read(directory.data(),sizeof(TriFileDirEntry)*numClusters))
+          return false;
+        for (size_t i=0; i<numClusters; ++i) {
+          const TriFileDirEntry &e = directory[i];
+          clusters[i].numVerts = e.numVerts;
+          clusters[i].numIndices = e.numIndices;
+          clusters[i].domain = e.domain;
+          clusters[i].vertexOffset = e.offset;
+          clusters[i].indexOffset = e.offset+sizeof(anari::math::float3)*e.numVerts;
+        }
+      }
+
+      return true;
+    }
+  };
+
+} // util
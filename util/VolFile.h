@@ -0,0 +1,289 @@
+#pragma once
+
+// std
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <vector>
+// anari
+#include "anari/anari_cpp/ext/linalg.h"
+// ours
+#include "BrickCodec.h"
+#include "box1.h"
+#include "box3.h"
+
+namespace util {
+
+  using box1 = anari::math::box1;
+  using box3 = anari::math::box3;
+  using box3i = anari::math::box3i;
+
+  // ======================================================
+  // On-disk layout of the .vols files written by chopSuey
+  //
+  // version 1 (legacy, no magic):
+  //   uint64 numBricks, box3i cellRange, box3i voxelRange,
+  //   box3 spaceRange,
+  //   per brick: box3i cellRange, box3i voxelRange,
+  //              box3 spaceRange, box1 valueRange,
+  //              float voxel[voxelRange.size()]
+  //
+  // version 2:
+  //   uint64 magic, uint64 version,
+  //   (version 1 header), int64 ghostWidth,
+  //   per brick: (as in version 1)
+  //
+  // version 3:
+  //   (version 2 header),
+  //   per brick: box3i cellRange, box3i voxelRange,
+  //              box3 spaceRange, box1 valueRange,
+  //              uint32 bpc, uint32 codec, uint64 storedBytes,
+  //              uint8 data[storedBytes]
+  //   voxels are stored in the input's type (bpc bytes),
+  //   encoded with the brick's codec (see BrickCodec.h);
+  //   valueRange is in normalized floats
+  //
+  // version 4:
+  //   (version 2 header), int64 macrocellSize,
+  //   per brick: (version 3 brick header),
+  //              box1 macrocells[macrocellDims(voxelRange)],
+  //              uint8 data[storedBytes]
+  //   macrocells partition the brick's cells into blocks of
+  //   macrocellSize^3 (x fastest), each storing the value
+  //   range of the voxels at its cells' corners
+  //
+  // version 5:
+  //   (version 4 header),
+  //   VolFileDirEntry directory[numBricks],
+  //   box1 macrocells[] of all bricks, in brick order,
+  //   per brick (at directory[i].offset):
+  //              uint8 data[storedBytes]
+  //   The brick table is read with two requests, however
+  //   many bricks there are; then each rank seeks to its
+  //   own bricks
+  //
+  // cellRanges don't overlap; voxelRanges extend to the
+  // neighbors' first voxel layer, so bricks can be sampled
+  // seamlessly up to their cellRange's upper boundary.
+  // With ghostWidth > 0, they extend by that many more
+  // voxel layers on each side (clamped to the volume)
+  // ======================================================
+
+  static const uint64_t volFileMagic = 0x534c4f5659455553ull; // "SUEYVOLS"
+  static const uint64_t volFileVersion = 5;
+  static const int defaultMacrocellSize = 16;
+
+  // Brick directory entry (version 5)
+  struct VolFileDirEntry {
+    box3i cellRange;
+    box3i voxelRange;
+    box3 spaceRange;
+    box1 valueRange;
+    uint32_t bpc;
+    uint32_t codec;
+    uint64_t storedBytes;
+    // absolute byte offset of the brick's data
+    uint64_t offset;
+  };
+  static_assert(sizeof(VolFileDirEntry)==2*sizeof(box3i)+sizeof(box3)+sizeof(box1)
+                                        +2*sizeof(uint32_t)+2*sizeof(uint64_t),
+                "VolFileDirEntry must not be padded");
+
+  // Number of macrocells of a brick with voxelDims voxels
+  inline anari::math::int3 macrocellDims(anari::math::int3 voxelDims, int macrocellSize)
+  {
+    using int3 = anari::math::int3;
+    int3 numCells = max(voxelDims-int3(1),int3(1));
+    return (numCells+int3(macrocellSize-1))/int3(macrocellSize);
+  }
+
+  // Value ranges of the macrocells of a brick of normalized float
+  // voxels; the voxel layers between macrocells are shared
+  inline void computeMacrocells(const float *voxels,
+                                anari::math::int3 voxelDims,
+                                int macrocellSize,
+                                box1 *macrocells)
+  {
+    using int3 = anari::math::int3;
+    int3 mcDims = macrocellDims(voxelDims,macrocellSize);
+    for (int i=0; i<mcDims.x*mcDims.y*mcDims.z; ++i)
+      macrocells[i] = box1(1e30f,-1e30f);
+
+    for (int z=0; z<voxelDims.z; ++z) {
+      int mz0 = std::min(z/macrocellSize,mcDims.z-1);
+      int mz1 = z%macrocellSize == 0 && z > 0 ? z/macrocellSize-1 : mz0;
+      for (int y=0; y<voxelDims.y; ++y) {
+        int my0 = std::min(y/macrocellSize,mcDims.y-1);
+        int my1 = y%macrocellSize == 0 && y > 0 ? y/macrocellSize-1 : my0;
+        const float *line = voxels+(z*size_t(voxelDims.y)+y)*voxelDims.x;
+        for (int x=0; x<voxelDims.x; ++x) {
+          int mx0 = std::min(x/macrocellSize,mcDims.x-1);
+          int mx1 = x%macrocellSize == 0 && x > 0 ? x/macrocellSize-1 : mx0;
+          // voxels on a macrocell boundary belong to both sides
+          for (int mz=mz1; mz<=mz0; ++mz)
+            for (int my=my1; my<=my0; ++my)
+              for (int mx=mx1; mx<=mx0; ++mx)
+                macrocells[(mz*size_t(mcDims.y)+my)*mcDims.x+mx].extend(line[x]);
+        }
+      }
+    }
+  }
+
+  struct VolFile {
+    struct Brick {
+      box3i cellRange;
+      box3i voxelRange;
+      box3 spaceRange;
+      box1 valueRange;
+      // bytes per voxel, and how the voxels are encoded
+      uint32_t bpc;
+      BrickCodec codec;
+      uint64_t storedBytes;
+      // value ranges of the macrocells; empty before version 4
+      std::vector<box1> macrocells;
+      // absolute byte offset of the brick's voxels
+      uint64_t voxelOffset;
+
+      anari::math::int3 dims() const
+      { return voxelRange.upper-voxelRange.lower; }
+
+      uint64_t numVoxels() const
+      { return dims().x*uint64_t(dims().y)*dims().z; }
+
+      // size of the decoded voxels
+      uint64_t numBytes() const
+      { return numVoxels()*bpc; }
+    };
+
+    box3i cellRange;
+    box3i voxelRange;
+    box3 spaceRange;
+    // union of the bricks' value ranges
+    box1 valueRange;
+    uint64_t version = 0;
+    int ghostWidth = 0;
+    // 0 if the file has no macrocells
+    int macrocellSize = 0;
+    std::vector<Brick> bricks;
+
+    // Positional read, so the header can be parsed from any
+    // backend (stream, MPI-IO, ...)
+    typedef std::function<bool(uint64_t offset, void *dst, size_t len)> ReadAt;
+
+    bool readHeader(const ReadAt &readAt) {
+      uint64_t pos = 0;
+      auto read = [&](void *dst, size_t len) {
+        if (!readAt(pos,dst,len))
+          return false;
+        pos += len;
+        return true;
+      };
+
+      uint64_t first, numBricks;
+      if (!read(&first,sizeof(first)))
+        return false;
+
+      if (first == volFileMagic) {
+        if (!read(&version,sizeof(version))
+         || !read(&numBricks,sizeof(numBricks)))
+          return false;
+        if (version < 2 || version > 5)
+          return false;
+      } else {
+        version = 1;
+        numBricks = first;
+      }
+
+      if (!read(&cellRange,sizeof(cellRange))
+       || !read(&voxelRange,sizeof(voxelRange))
+       || !read(&spaceRange,sizeof(spaceRange)))
+        return false;
+
+      ghostWidth = 0;
+      if (version >= 2) {
+        int64_t gw;
+        if (!read(&gw,sizeof(gw)))
+          return false;
+        ghostWidth = (int)gw;
+      }
+
+      macrocellSize = 0;
+      if (version >= 4) {
+        int64_t mcs;
+        if (!read(&mcs,sizeof(mcs)) || mcs <= 0)
+          return false;
+        macrocellSize = (int)mcs;
+      }
+
+      valueRange = box1(1e30f,-1e30f);
+      bricks.resize(numBricks);
+
+      if (version >= 5) {
+        std::vector<VolFileDirEntry> directory(numBricks);
+        if (!read(directory.data(),sizeof(VolFileDirEntry)*numBricks))
+          return false;
+
+        size_t numMacrocells = 0;
+        for (size_t i=0; i<numBricks; ++i) {
+          const VolFileDirEntry &e = directory[i];
+          Brick &b = bricks[i];
+          b.cellRange = e.cellRange;
+          b.voxelRange = e.voxelRange;
+          b.spaceRange = e.spaceRange;
+          b.valueRange = e.valueRange;
+          b.bpc = e.bpc;
+          b.codec = (BrickCodec)e.codec;
+          b.storedBytes = e.storedBytes;
+          b.voxelOffset = e.offset;
+          anari::math::int3 mcDims = macrocellDims(b.dims(),macrocellSize);
+          b.macrocells.resize(mcDims.x*size_t(mcDims.y)*mcDims.z);
+          numMacrocells += b.macrocells.size();
+          valueRange.extend(b.valueRange);
+        }
+
+        std::vector<box1> macrocells(numMacrocells);
+        if (!read(macrocells.data(),sizeof(box1)*numMacrocells))
+          return false;
+        const box1 *mc = macrocells.data();
+        for (auto &b : bricks) {
+          std::copy(mc,mc+b.macrocells.size(),b.macrocells.begin());
+          mc += b.macrocells.size();
+        }
+
+        return true;
+      }
+
+      for (auto &b : bricks) {
+        if (!read(&b.cellRange,sizeof(b.cellRange))
+         || !read(&b.voxelRange,sizeof(b.voxelRange))
+         || !read(&b.spaceRange,sizeof(b.spaceRange))
+         || !read(&b.valueRange,sizeof(b.valueRange)))
+          return false;
+        if (version >= 3) {
+          uint32_t codec;
+          if (!read(&b.bpc,sizeof(b.bpc))
+           || !read(&codec,sizeof(codec))
+           || !read(&b.storedBytes,sizeof(b.storedBytes)))
+            return false;
+          b.codec = (BrickCodec)codec;
+          if (macrocellSize > 0) {
+            anari::math::int3 mcDims = macrocellDims(b.dims(),macrocellSize);
+            b.macrocells.resize(mcDims.x*size_t(mcDims.y)*mcDims.z);
+            if (!read(b.macrocells.data(),sizeof(box1)*b.macrocells.size()))
+              return false;
+          }
+        } else {
+          b.bpc = sizeof(float);
+          b.codec = BrickCodec::None;
+          b.storedBytes = b.numBytes();
+        }
+        b.voxelOffset = pos;
+        pos += b.storedBytes;
+        valueRange.extend(b.valueRange);
+      }
+
+      return true;
+    }
+  };
+
+} // util
@@ -1,9 +1,27 @@
 #include <algorithm>
+#include <atomic>
+#include <cstdio>
 #include <fstream>
 #include <iostream>
+#include <memory>
+#include <unordered_map>
 #include <vector>
 #include <float.h>
+#include <math.h>
+#include <string.h>
+#ifdef _WIN32
+#include <mutex>
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+#include "BrickCodec.h"
+#include "FileMapping.h"
 #include "mesh.h"
+#include "ThreadPool.h"
+#include "TriFile.h"
+#include "VolFile.h"
 #include "volume.h"
 #include "box1.h"
 #include "box3.h"
@@ -30,16 +48,27 @@ namespace util {
   std::ostream &operator<<(std::ostream &out, box3i b)
   { out<<'['<<b.lower<<':'<<b.upper<<']'; return out; }
 
-  enum class Strategy { Middle, Median, };
+  enum class Strategy { Middle, Median, Binned, };
 
   struct {
     std::string inFileName = "";
     std::string outFileName = "chopSuey.tri";
     unsigned  numClusters = 1;
+    unsigned  numThreads = 0; // 0: hardware concurrency
+    bool stream = false;
+    size_t memoryBudget = size_t(1)<<30;
     Strategy strategy = Strategy::Median;
     struct {
       int3 dims{0};
       int bpc{1};
+      // >0: convert to the bricked layout instead of splitting
+      int brickSize{0};
+      // extra voxel layers around each brick
+      int ghostWidth{0};
+      // edge length (in cells) of the bricks' macrocells
+      int macrocellSize{defaultMacrocellSize};
+      // compress the bricks of .vols files
+      bool compress{false};
     } volume;
   } cmdline;
 
@@ -49,7 +78,13 @@ namespace util {
       std::cout << TERMINAL_RED << "\nFatal error: " << err
                 << TERMINAL_DEFAULT << std::endl << std::endl;
 
-    std::cout << "Usage: ./chopSuey inFile.obj -o outFile.tri -n numClusters" << std::endl;
+    std::cout << "Usage: ./chopSuey inFile.obj -o outFile.tri -n numClusters "
+              << "[-strategy middle|median|binned] [-threads N] [-stream [-mem MB]]" << std::endl;
+    std::cout << "       ./chopSuey inFile.raw -dims x y z -type uint8|uint16|float "
+              << "-o outFile.vols -n numClusters [-ghost N] [-macrocell N] [-compress] [-threads N]" << std::endl;
+    std::cout << "       ./chopSuey inFile.raw -dims x y z -type uint8|uint16|float "
+              << "-o outFile.bvol -bricked [brickSize]" << std::endl;
+    std::cout << "       ./chopSuey inFile.bvol -o outFile.vols -n numClusters [-ghost N] [-macrocell N] [-compress] [-threads N]" << std::endl;
     std::cout << std::endl;
     exit(1);
   }
@@ -62,7 +97,76 @@ namespace util {
     return fileName.substr(pos);
   }
 
-  /* Mesh splitter. Meshes may only contain *one* geom! */
+  /* Output file that can be written to at arbitrary offsets from
+     multiple threads */
+  struct OutFile {
+    OutFile(const std::string &fileName) {
+#ifdef _WIN32
+      ofs.open(fileName,std::ios::binary);
+#else
+      fd = open(fileName.c_str(),O_WRONLY|O_CREAT|O_TRUNC,0644);
+#endif
+    }
+
+   ~OutFile() {
+      close();
+    }
+
+    void close() {
+#ifdef _WIN32
+      ofs.close();
+#else
+      if (fd >= 0)
+        ::close(fd);
+      fd = -1;
+#endif
+    }
+
+    bool good() const {
+#ifdef _WIN32
+      return ofs.good();
+#else
+      return fd >= 0;
+#endif
+    }
+
+    bool writeAt(const void *data, size_t len, size_t offset) {
+#ifdef _WIN32
+      std::lock_guard<std::mutex> l(mutex);
+      ofs.seekp(offset);
+      ofs.write((const char *)data,len);
+      return ofs.good();
+#else
+      const char *p = (const char *)data;
+      while (len > 0) {
+        ssize_t n = pwrite(fd,p,len,offset);
+        if (n < 0) {
+          if (errno == EINTR)
+            continue;
+          perror("pwrite");
+          return false;
+        }
+        p += n;
+        len -= n;
+        offset += n;
+      }
+      return true;
+#endif
+    }
+
+#ifdef _WIN32
+    std::ofstream ofs;
+    std::mutex mutex;
+#else
+    int fd = -1;
+#endif
+  };
+
+  /* Mesh splitter. Splits the mesh's first geom; meshes with multiple
+     geoms (e.g., OBJ shapes) are merged into one by main() first. Splits
+     recursively; each subtree gets a budget of clusters, so subtrees
+     are independent and are processed concurrently. The output only
+     depends on the input and strategy, not on the number of threads */
   struct MeshSplitter {
 
     struct Domain {
@@ -72,76 +176,85 @@ namespace util {
 
     struct PrimRef {
       unsigned primID;
+      // used to pick the split plane
       float3 centroid;
+      // used to assign the prim to a side
+      float3 lower;
     };
 
-    MeshSplitter(unsigned numClusters, const Mesh::SP& mesh, const box3 bounds)
-      : numClustersDesired(numClusters)
+    // Ranges smaller than this are processed serially
+    static const size_t parallelThreshold = 1<<16;
+
+    // Binned splits keep the clusters' prim counts within this factor
+    // of the average
+    static constexpr float maxFill = 1.25f;
+
+    MeshSplitter(unsigned numClusters,
+                 const Mesh::SP& mesh,
+                 const box3 bounds,
+                 Strategy strategy,
+                 ThreadPool &pool)
+      : strategy(strategy)
+      , numClustersDesired(numClusters)
       , mesh(mesh)
       , modelBounds(bounds)
+      , pool(pool)
     {
       Domain domain;
       domain.first = 0;
       domain.last  = mesh->geoms[0]->index.size();
       domain.bounds = modelBounds;
 
-      clusters.push_back(domain);
-
-      if (strategy != Strategy::Middle) {
-
-        primRefs.resize(mesh->geoms[0]->index.size());
+      const Geometry::SP &geom = mesh->geoms[0];
+      primRefs.resize(geom->index.size());
+      scratch.resize(geom->index.size());
 
-        for (size_t i=0; i<mesh->geoms[0]->index.size(); ++i) {
-          int3 idx = mesh->geoms[0]->index[i];
+      pool.parallelFor(0,primRefs.size(),parallelThreshold,[&](size_t b, size_t e) {
+        for (size_t i=b; i<e; ++i) {
+          int3 idx = geom->index[i];
           box3 primBounds = { float3(1e30f), float3(-1e30f) };
-          primBounds.extend(mesh->geoms[0]->vertex[idx.x]);
-          primBounds.extend(mesh->geoms[0]->vertex[idx.y]);
-          primBounds.extend(mesh->geoms[0]->vertex[idx.z]);
-          primRefs[i] = {(unsigned)i,primBounds.center()};
+          primBounds.extend(geom->vertex[idx.x]);
+          primBounds.extend(geom->vertex[idx.y]);
+          primBounds.extend(geom->vertex[idx.z]);
+          primRefs[i] = {(unsigned)i,primBounds.center(),primBounds.lower};
         }
+      });
+
+      // One slot per desired cluster; slots of empty domains stay invalid
+      slots.resize(std::max(1u,numClustersDesired));
+
+      ThreadPool::TaskGroup group;
+      pool.spawn(group, [=]() { doSplit(domain,0,(unsigned)slots.size()); });
+      pool.wait(group);
+
+      for (auto &slot : slots) {
+        if (slot.valid)
+          clusters.push_back(slot.domain);
       }
 
-      if (numClustersDesired > 1)
-        doSplit();
+      // Bring the triangles into cluster order
+      std::vector<int3> index(geom->index.size());
+      pool.parallelFor(0,primRefs.size(),parallelThreshold,[&](size_t b, size_t e) {
+        for (size_t i=b; i<e; ++i)
+          index[i] = geom->index[primRefs[i].primID];
+      });
+      geom->index.swap(index);
 
       for (auto d : clusters) {
         std::cout << d.first << ' ' << d.last << ' ' << d.bounds << '\n';
       }
     }
 
-    void doSplit() {
-      Domain domain;
-
-      unsigned clusterToPick = 0;
-
-      if (strategy == Strategy::Middle) {
-        // Pick cluster with highest volume
-        unsigned maxVolumeIndex = 0;
-        float maxVolume = 0.f;
-        for (unsigned i=0; i<clusters.size(); ++i)
-        {
-          if (clusters[i].bounds.volume() > maxVolume) {
-            maxVolumeIndex = i;
-            maxVolume = clusters[i].bounds.volume();
-          }
-        }
-        clusterToPick = maxVolumeIndex;
-      } else if (strategy == Strategy::Median) {
-        // Pick cluster with most prims
-        unsigned maxNumPrimsIndex = 0;
-        unsigned maxNumPrims = 0;
-        for (unsigned i=0; i<clusters.size(); ++i)
-        {
-          if (clusters[i].last-clusters[i].first > maxNumPrims) {
-            maxNumPrimsIndex = i;
-            maxNumPrims = clusters[i].last-clusters[i].first;
-          }
-        }
-        clusterToPick = maxNumPrimsIndex;
+    // Split domain into (at most) numSlots clusters, written to
+    // slots[firstSlot,firstSlot+numSlots)
+    void doSplit(Domain domain, unsigned firstSlot, unsigned numSlots) {
+      if (numSlots <= 1 || domain.last-domain.first <= 1) {
+        slots[firstSlot] = {domain,domain.last > domain.first};
+        return;
       }
 
-      domain = clusters[clusterToPick];
-      clusters.erase(clusters.begin()+clusterToPick);
+      unsigned numSlotsL = numSlots/2;
+      unsigned numSlotsR = numSlots-numSlotsL;
 
       int splitAxis = 0;
       if (domain.bounds.size()[1]>domain.bounds.size()[0]
@@ -157,43 +270,27 @@ namespace util {
       if (strategy == Strategy::Middle)
         splitPlane = domain.bounds.lower[splitAxis]+domain.bounds.size()[splitAxis]*.5f;
       else if (strategy == Strategy::Median) {
-        std::sort(primRefs.begin()+domain.first,
-                  primRefs.begin()+domain.last,
-                  [splitAxis](const PrimRef a, const PrimRef b) {
-                    return a.centroid[splitAxis] < b.centroid[splitAxis];
-                  });
-        size_t num = size_t(primRefs.size()/float(numClustersDesired));
-        splitPlane = primRefs[domain.first+num].centroid[splitAxis];
-      }
-
-      std::partition(mesh->geoms[0]->index.begin()+domain.first,
-                     mesh->geoms[0]->index.begin()+domain.last,
-                     [&](int3 idx) {
-                        const float3 &v1(mesh->geoms[0]->vertex[idx.x]);
-                        const float3 &v2(mesh->geoms[0]->vertex[idx.y]);
-                        const float3 &v3(mesh->geoms[0]->vertex[idx.z]);
-
-                        float l = fminf(v1[splitAxis],fminf(v2[splitAxis],v3[splitAxis]));
-
-                        return l<splitPlane;
-                     });
-
-      // Find first primitive where l >= splitPlane
-      unsigned splitIndex = domain.first;
-      for (unsigned i=domain.first; i<domain.last; ++i) {
-        int3 idx = mesh->geoms[0]->index[i];
-        const float3 &v1(mesh->geoms[0]->vertex[idx.x]);
-        const float3 &v2(mesh->geoms[0]->vertex[idx.y]);
-        const float3 &v3(mesh->geoms[0]->vertex[idx.z]);
-
-        float l = fminf(v1[splitAxis],fminf(v2[splitAxis],v3[splitAxis]));
-
-        if (l >= splitPlane) {
-          splitIndex = i;
-          break;
+        // Place the plane so the prims are distributed like the slots
+        size_t num = size_t((domain.last-domain.first)*uint64_t(numSlotsL)/numSlots);
+        splitPlane = selectCentroid(domain.first,domain.last,num,splitAxis);
+      }
+      else if (strategy == Strategy::Binned) {
+        BinnedSplit split = findBinnedSplit(domain.first,domain.last,numSlots);
+        if (split.axis >= 0) {
+          splitAxis = split.axis;
+          splitPlane = split.plane;
+          numSlotsL = split.numSlotsLeft;
+          numSlotsR = numSlots-numSlotsL;
+        } else {
+          // All prims start at the same position, or no bin boundary
+          // gives balanced clusters; fall back to median
+          size_t num = size_t((domain.last-domain.first)*uint64_t(numSlotsL)/numSlots);
+          splitPlane = selectCentroid(domain.first,domain.last,num,splitAxis);
         }
       }
 
+      unsigned splitIndex = partition(domain.first,domain.last,splitAxis,splitPlane);
+
       Domain L;
       L.first  = domain.first;
       L.last   = splitIndex;
@@ -206,45 +303,873 @@ namespace util {
       R.bounds = domain.bounds;
       R.bounds.lower[splitAxis] = splitPlane;
 
-      if (L.last-L.first > 0)
-        clusters.push_back(L);
+      // If one side is empty, the other one continues with one
+      // slot less (which also guarantees termination)
+      if (L.last-L.first == 0) {
+        slots[firstSlot].valid = false;
+        doSplit(R,firstSlot+1,numSlots-1);
+        return;
+      } else if (R.last-R.first == 0) {
+        slots[firstSlot+numSlots-1].valid = false;
+        doSplit(L,firstSlot,numSlots-1);
+        return;
+      }
 
-      if (R.last-R.first > 0)
-        clusters.push_back(R);
+      ThreadPool::TaskGroup group;
+      pool.spawn(group, [=]() { doSplit(L,firstSlot,numSlotsL); });
+      doSplit(R,firstSlot+numSlotsL,numSlotsR);
+      pool.wait(group);
+    }
 
-      if (clusters.size() < numClustersDesired)
-        doSplit();
+    // box3/box1::extend() don't handle empty boxes
+    static bool empty(const box1 &b)
+    { return b.lower > b.upper; }
+
+    static bool empty(const box3 &b)
+    { return b.lower.x > b.upper.x; }
+
+    // Value of the num'th smallest centroid in primRefs[first,last);
+    // the result is unique, however it is computed
+    float selectCentroid(size_t first, size_t last, size_t num, int axis) {
+      size_t n = last-first;
+
+      if (n < parallelThreshold) {
+        std::vector<float> values(n);
+        for (size_t i=0; i<n; ++i)
+          values[i] = primRefs[first+i].centroid[axis];
+        std::nth_element(values.begin(),values.begin()+num,values.end());
+        return values[num];
+      }
+
+      // Parallel selection: histogram the centroids, find the bin that
+      // contains the num'th value, and select within that bin only
+      const int numBins = 4096;
+      size_t numChunks = (n+parallelThreshold-1)/parallelThreshold;
+
+      std::vector<box1> chunkRanges(numChunks,box1(FLT_MAX,-FLT_MAX));
+      pool.parallelFor(first,last,parallelThreshold,[&](size_t b, size_t e) {
+        box1 &r = chunkRanges[(b-first)/parallelThreshold];
+        for (size_t i=b; i<e; ++i)
+          r.extend(primRefs[i].centroid[axis]);
+      });
+      box1 range(FLT_MAX,-FLT_MAX);
+      for (auto &r : chunkRanges) {
+        if (!empty(r))
+          range.extend(r);
+      }
+
+      if (range.size() <= 0.f)
+        return range.lower;
+
+      auto binID = [&](float v) {
+        int b = int((v-range.lower)/range.size()*numBins);
+        return std::min(std::max(b,0),numBins-1);
+      };
+
+      std::vector<size_t> chunkCounts(numChunks*numBins,0);
+      pool.parallelFor(first,last,parallelThreshold,[&](size_t b, size_t e) {
+        size_t *counts = chunkCounts.data()+(b-first)/parallelThreshold*numBins;
+        for (size_t i=b; i<e; ++i)
+          counts[binID(primRefs[i].centroid[axis])]++;
+      });
+
+      int bin = 0;
+      size_t numBefore = 0;
+      for (; bin<numBins; ++bin) {
+        size_t count = 0;
+        for (size_t c=0; c<numChunks; ++c)
+          count += chunkCounts[c*numBins+bin];
+        if (numBefore+count > num)
+          break;
+        numBefore += count;
+      }
+
+      std::vector<float> values;
+      for (size_t i=first; i<last; ++i) {
+        float v = primRefs[i].centroid[axis];
+        if (binID(v) == bin)
+          values.push_back(v);
+      }
+      size_t k = num-numBefore;
+      std::nth_element(values.begin(),values.begin()+k,values.end());
+      return values[k];
+    }
+
+    struct BinnedSplit {
+      // -1 if there is no valid split
+      int axis;
+      float plane;
+      // slots for the left side; the prims are distributed like them
+      unsigned numSlotsLeft;
+    };
+
+    // Binned SAH over the prims' lower bounds (which partition() uses to
+    // assign prims to sides); one pass over the prims, independent of
+    // how they are ordered. Only planes that leave both sides' clusters
+    // within maxFill of the average prim count are considered, so the
+    // result is balanced like the median split's
+    BinnedSplit findBinnedSplit(size_t first, size_t last, unsigned numSlots) {
+      const int numBins = 32;
+
+      double avgFill = double(primRefs.size())/slots.size();
+      auto balanced = [&](size_t count, unsigned n) {
+        double fill = double(count)/n;
+        return fill <= avgFill*maxFill && fill >= avgFill/maxFill;
+      };
+
+      struct Bin {
+        box3 bounds = { float3(FLT_MAX), float3(-FLT_MAX) };
+        size_t count = 0;
+      };
+
+      size_t n = last-first;
+      size_t numChunks = (n+parallelThreshold-1)/parallelThreshold;
+
+      std::vector<box3> chunkRanges(numChunks,{ float3(FLT_MAX), float3(-FLT_MAX) });
+      pool.parallelFor(first,last,parallelThreshold,[&](size_t b, size_t e) {
+        box3 &r = chunkRanges[(b-first)/parallelThreshold];
+        for (size_t i=b; i<e; ++i)
+          r.extend(primRefs[i].lower);
+      });
+      box3 range = { float3(FLT_MAX), float3(-FLT_MAX) };
+      for (auto &r : chunkRanges) {
+        if (!empty(r))
+          range.extend(r);
+      }
+
+      auto binID = [&](float v, int axis) {
+        int b = int((v-range.lower[axis])/range.size()[axis]*numBins);
+        return std::min(std::max(b,0),numBins-1);
+      };
+
+      std::vector<Bin> chunkBins(numChunks*3*numBins);
+      pool.parallelFor(first,last,parallelThreshold,[&](size_t b, size_t e) {
+        Bin *bins = chunkBins.data()+(b-first)/parallelThreshold*3*numBins;
+        for (size_t i=b; i<e; ++i) {
+          const PrimRef &ref = primRefs[i];
+          // prim bounds are symmetric around the centroid
+          float3 upper = ref.centroid*2.f-ref.lower;
+          for (int axis=0; axis<3; ++axis) {
+            if (range.size()[axis] <= 0.f)
+              continue;
+            Bin &bin = bins[axis*numBins+binID(ref.lower[axis],axis)];
+            bin.bounds.extend(ref.lower);
+            bin.bounds.extend(upper);
+            bin.count++;
+          }
+        }
+      });
+
+      auto halfArea = [](const box3 &b) {
+        if (empty(b))
+          return 0.f;
+        float3 s = b.size();
+        return s.x*s.y+s.y*s.z+s.z*s.x;
+      };
+
+      BinnedSplit best{-1,0.f,0};
+      float bestCost = FLT_MAX;
+      for (int axis=0; axis<3; ++axis) {
+        if (range.size()[axis] <= 0.f)
+          continue;
+
+        Bin bins[numBins];
+        for (size_t c=0; c<numChunks; ++c) {
+          for (int i=0; i<numBins; ++i) {
+            const Bin &bin = chunkBins[(c*3+axis)*numBins+i];
+            if (bin.count == 0)
+              continue;
+            bins[i].bounds.extend(bin.bounds);
+            bins[i].count += bin.count;
+          }
+        }
+
+        // Sweep from the right, then evaluate the planes from the left
+        float areaR[numBins];
+        size_t countR[numBins];
+        Bin accum;
+        for (int i=numBins-1; i>0; --i) {
+          if (bins[i].count > 0)
+            accum.bounds.extend(bins[i].bounds);
+          accum.count += bins[i].count;
+          areaR[i] = halfArea(accum.bounds);
+          countR[i] = accum.count;
+        }
+
+        accum = Bin();
+        for (int i=1; i<numBins; ++i) {
+          if (bins[i-1].count > 0)
+            accum.bounds.extend(bins[i-1].bounds);
+          accum.count += bins[i-1].count;
+          if (accum.count == 0 || countR[i] == 0)
+            continue;
+
+          // Distribute the slots like the prims
+          uint64_t n = accum.count+countR[i];
+          unsigned numSlotsL = unsigned((accum.count*uint64_t(numSlots)+n/2)/n);
+          numSlotsL = std::min(std::max(numSlotsL,1u),numSlots-1);
+          if (!balanced(accum.count,numSlotsL) || !balanced(countR[i],numSlots-numSlotsL))
+            continue;
+
+          float cost = halfArea(accum.bounds)*accum.count+areaR[i]*countR[i];
+          if (cost < bestCost) {
+            bestCost = cost;
+            best.axis = axis;
+            best.plane = range.lower[axis]+range.size()[axis]*i/numBins;
+            best.numSlotsLeft = numSlotsL;
+          }
+        }
+      }
+
+      return best;
+    }
+
+    // Stable partition of primRefs[first,last) by the prims' lower
+    // bounds; returns the first prim where lower >= splitPlane
+    unsigned partition(size_t first, size_t last, int axis, float splitPlane) {
+      auto isLeft = [=](const PrimRef &ref) {
+        return ref.lower[axis] < splitPlane;
+      };
+
+      size_t n = last-first;
+      if (n < parallelThreshold) {
+        auto it = std::stable_partition(primRefs.begin()+first,
+                                        primRefs.begin()+last,
+                                        isLeft);
+        return unsigned(it-primRefs.begin());
+      }
+
+      // Count per chunk, then scatter each chunk to its offsets in
+      // the scratch buffer; same result as std::stable_partition
+      size_t numChunks = (n+parallelThreshold-1)/parallelThreshold;
+      std::vector<size_t> numLeft(numChunks,0);
+      pool.parallelFor(first,last,parallelThreshold,[&](size_t b, size_t e) {
+        size_t &count = numLeft[(b-first)/parallelThreshold];
+        for (size_t i=b; i<e; ++i)
+          count += isLeft(primRefs[i]);
+      });
+
+      std::vector<size_t> offsetL(numChunks), offsetR(numChunks);
+      size_t totalLeft = 0;
+      for (size_t c=0; c<numChunks; ++c) {
+        offsetL[c] = totalLeft;
+        totalLeft += numLeft[c];
+      }
+      size_t numRight = 0;
+      for (size_t c=0; c<numChunks; ++c) {
+        offsetR[c] = totalLeft+numRight;
+        size_t chunkSize = std::min(parallelThreshold,n-c*parallelThreshold);
+        numRight += chunkSize-numLeft[c];
+      }
+
+      pool.parallelFor(first,last,parallelThreshold,[&](size_t b, size_t e) {
+        size_t c = (b-first)/parallelThreshold;
+        size_t l = first+offsetL[c], r = first+offsetR[c];
+        for (size_t i=b; i<e; ++i) {
+          if (isLeft(primRefs[i]))
+            scratch[l++] = primRefs[i];
+          else
+            scratch[r++] = primRefs[i];
+        }
+      });
+
+      pool.parallelFor(first,last,parallelThreshold,[&](size_t b, size_t e) {
+        std::copy(scratch.begin()+b,scratch.begin()+e,primRefs.begin()+b);
+      });
+
+      return unsigned(first+totalLeft);
     }
 
     void saveTris(const std::string& fn) {
       uint64_t numClusters = clusters.size();
-      uint64_t numVerts = mesh->geoms[0]->vertex.size();
 
       std::ofstream ofs(fn,std::ios::binary);
+      ofs.write((char *)&triFileMagic,sizeof(triFileMagic));
+      ofs.write((char *)&triFileVersion,sizeof(triFileVersion));
       ofs.write((char *)&numClusters,sizeof(numClusters));
       ofs.write((char *)&modelBounds,sizeof(modelBounds));
-      ofs.write((char *)&numVerts,sizeof(numVerts));
-      ofs.write((char *)mesh->geoms[0]->vertex.data(),sizeof(float3)*numVerts);
+
+      // Reserve space for the cluster directory, written at the end
+      // once all the offsets are known
+      std::vector<TriFileDirEntry> directory(numClusters);
+      uint64_t directoryPos = ofs.tellp();
+      ofs.seekp(directoryPos+sizeof(TriFileDirEntry)*numClusters);
+
+      writeClusters(ofs,directory.data());
+
+      ofs.seekp(directoryPos);
+      ofs.write((char *)directory.data(),sizeof(TriFileDirEntry)*numClusters);
+    }
+
+    // Write the clusters' vertex and index blocks at the current
+    // position and fill in their directory entries
+    void writeClusters(std::ostream &ofs, TriFileDirEntry *directory) {
+      // Each cluster gets its own, compacted vertex block; remap
+      // global to cluster-local vertex indices
+      const std::vector<float3> &globalVertices = mesh->geoms[0]->vertex;
+      std::vector<int> remap(globalVertices.size(),-1);
+      std::vector<float3> vertices;
+      std::vector<int3> indices;
 
       for (unsigned i=0; i<clusters.size(); ++i)
       {
         Domain domain = clusters[i];
-        uint64_t numIndices = domain.last-domain.first;
-        ofs.write((char *)&numIndices,sizeof(numIndices));
-        ofs.write((char *)&domain.bounds,sizeof(domain.bounds));
-        ofs.write((char *)(mesh->geoms[0]->index.data()+domain.first),sizeof(int3)*numIndices);
+        vertices.clear();
+        indices.clear();
+        auto local = [&](int index) {
+          if (remap[index] < 0) {
+            remap[index] = (int)vertices.size();
+            vertices.push_back(globalVertices[index]);
+          }
+          return remap[index];
+        };
+        for (unsigned j=domain.first; j<domain.last; ++j) {
+          int3 idx = mesh->geoms[0]->index[j];
+          indices.push_back({local(idx.x),local(idx.y),local(idx.z)});
+        }
+        // reset for the next cluster
+        for (unsigned j=domain.first; j<domain.last; ++j) {
+          int3 idx = mesh->geoms[0]->index[j];
+          remap[idx.x] = remap[idx.y] = remap[idx.z] = -1;
+        }
+
+        TriFileDirEntry &entry = directory[i];
+        entry.offset = ofs.tellp();
+        entry.numVerts = vertices.size();
+        entry.numIndices = indices.size();
+        entry.numBytes = sizeof(float3)*entry.numVerts+sizeof(int3)*entry.numIndices;
+        entry.domain = domain.bounds;
+        ofs.write((char *)vertices.data(),sizeof(float3)*entry.numVerts);
+        ofs.write((char *)indices.data(),sizeof(int3)*entry.numIndices);
       }
     }
 
-    Strategy strategy = Strategy::Median;
+    Strategy strategy;
 
     unsigned numClustersDesired;
     Mesh::SP mesh;
     box3 modelBounds;
 
+    ThreadPool &pool;
+
     std::vector<Domain> clusters;
 
+    struct Slot {
+      Domain domain;
+      bool valid;
+    };
+    std::vector<Slot> slots;
+
     std::vector<PrimRef> primRefs;
+    std::vector<PrimRef> scratch;
+  };
+
+  /* Out-of-core mesh splitter for OBJ files that don't fit in memory.
+     Makes a few streaming passes over the OBJ file: the vertices are
+     written to a binary scratch file that is mapped into memory, the
+     triangles are binned into spatial buckets on disk (each of which
+     fits in the memory budget), then each bucket is loaded and split
+     with the in-core MeshSplitter. Buckets whose cluster budget is a
+     single cluster are still split until they fit, their parts are
+     merged into one cluster. Only v and f statements are used */
+  struct StreamingMeshSplitter {
+
+    // Bytes per triangle when a bucket is split in-core (index,
+    // compacted vertices, prim refs, scratch space), rough estimate
+    static const size_t bytesPerTriangle = 128;
+
+    // Resolution of the histogram the buckets are built from
+    static const int histogramCells = 1<<18;
+
+    struct Bucket {
+      box3i cellRange;
+      box3 bounds;
+      unsigned numClusters;
+      uint64_t numTriangles;
+      std::string fileName;
+      // part of the same (single) cluster as the previous bucket
+      bool merged;
+    };
+
+    StreamingMeshSplitter(unsigned numClusters,
+                          const std::string &inFileName,
+                          const std::string &outFileName,
+                          size_t memoryBudget,
+                          Strategy strategy,
+                          ThreadPool &pool)
+      : numClustersDesired(std::max(1u,numClusters))
+      , inFileName(inFileName)
+      , outFileName(outFileName)
+      , strategy(strategy)
+      , pool(pool)
+      , memoryBudget(memoryBudget)
+    {
+      bucketCapacity = std::max<size_t>(1,memoryBudget/bytesPerTriangle);
+    }
+
+    // Triangles buffered per bucket when scattering them to the
+    // bucket files, see writeBuckets()
+    static const size_t minScatterBufferSize = 1024;
+
+    bool run() {
+      vertexFileName = outFileName+".verts";
+
+      if (!writeVertices())
+        return false;
+
+      // The vertices are accessed randomly, leave the paging to the OS
+      vertexFile.reset(new FileMapping(vertexFileName));
+      vertices = (const float3 *)vertexFile->data();
+
+      buildHistogram();
+      bool ok = buildBuckets() && writeBuckets() && splitBuckets();
+
+      vertexFile.reset();
+      std::remove(vertexFileName.c_str());
+
+      return ok;
+    }
+
+   private:
+    // Calls func(triangle) for each face (fans for polygons), with
+    // zero-based, absolute vertex indices
+    template <typename Func>
+    bool forEachTriangle(Func func) {
+      std::ifstream in(inFileName);
+      if (!in.good()) {
+        std::cerr << "Cannot open " << inFileName << '\n';
+        return false;
+      }
+
+      int64_t numVertsSeen = 0;
+      std::vector<int> face;
+      std::string line;
+      while (std::getline(in,line)) {
+        const char *p = line.c_str();
+        if (p[0] == 'v' && (p[1] == ' ' || p[1] == '\t')) {
+          numVertsSeen++;
+        } else if (p[0] == 'f' && (p[1] == ' ' || p[1] == '\t')) {
+          face.clear();
+          p++;
+          while (true) {
+            char *end;
+            long i = strtol(p,&end,10);
+            if (end == p)
+              break;
+            face.push_back(int(i < 0 ? numVertsSeen+i : i-1));
+            // skip texcoord/normal indices
+            p = end;
+            while (*p && *p != ' ' && *p != '\t')
+              p++;
+          }
+          for (size_t i=2; i<face.size(); ++i)
+            func(int3(face[0],face[i-1],face[i]));
+        }
+      }
+      return true;
+    }
+
+    bool writeVertices() {
+      std::ifstream in(inFileName);
+      std::ofstream out(vertexFileName,std::ios::binary);
+      if (!in.good() || !out.good()) {
+        std::cerr << "Cannot open " << inFileName << " or " << vertexFileName << '\n';
+        return false;
+      }
+
+      bounds = { float3(FLT_MAX), float3(-FLT_MAX) };
+      numVertices = 0;
+
+      std::string line;
+      while (std::getline(in,line)) {
+        const char *p = line.c_str();
+        if (p[0] == 'v' && (p[1] == ' ' || p[1] == '\t')) {
+          char *end;
+          float3 v;
+          v.x = strtof(p+1,&end);
+          v.y = strtof(end,&end);
+          v.z = strtof(end,&end);
+          out.write((const char *)&v,sizeof(v));
+          bounds.extend(v);
+          numVertices++;
+        }
+      }
+
+      if (numVertices == 0) {
+        std::cerr << "No vertices in " << inFileName << '\n';
+        return false;
+      }
+
+      std::cout << "#verts: " << numVertices << '\n';
+      return true;
+    }
+
+    box3 triangleBounds(int3 tri) const {
+      box3 b = { float3(FLT_MAX), float3(-FLT_MAX) };
+      b.extend(vertices[tri.x]);
+      b.extend(vertices[tri.y]);
+      b.extend(vertices[tri.z]);
+      return b;
+    }
+
+    bool valid(int3 tri) const {
+      return tri.x >= 0 && tri.x < numVertices
+          && tri.y >= 0 && tri.y < numVertices
+          && tri.z >= 0 && tri.z < numVertices;
+    }
+
+    // Triangles are assigned to cells (and buckets) by their lower
+    // corner, like MeshSplitter assigns them to clusters
+    int3 cellID(float3 p) const {
+      float3 size = bounds.size();
+      int3 c;
+      for (int i=0; i<3; ++i) {
+        c[i] = size[i] > 0.f ? int((p[i]-bounds.lower[i])/size[i]*cellDims[i]) : 0;
+        c[i] = std::min(std::max(c[i],0),cellDims[i]-1);
+      }
+      return c;
+    }
+
+    size_t linearCellID(int3 c) const
+    { return (size_t(c.z)*cellDims.y+c.y)*cellDims.x+c.x; }
+
+    void buildHistogram() {
+      // Cells proportional to the extent of the bounds
+      float3 size = bounds.size();
+      float maxSize = std::max(size.x,std::max(size.y,size.z));
+      float3 rel = maxSize > 0.f ? size/maxSize : float3(1.f);
+      float volume = std::max(rel.x,1e-3f)*std::max(rel.y,1e-3f)*std::max(rel.z,1e-3f);
+      float scale = cbrtf(histogramCells/volume);
+      for (int i=0; i<3; ++i)
+        cellDims[i] = std::max(1,int(rel[i]*scale));
+
+      histogram.assign(size_t(cellDims.x)*cellDims.y*cellDims.z,0);
+      numTriangles = 0;
+      forEachTriangle([&](int3 tri) {
+        if (!valid(tri))
+          return;
+        histogram[linearCellID(cellID(triangleBounds(tri).lower))]++;
+        numTriangles++;
+      });
+
+      std::cout << "#tris: " << numTriangles << '\n';
+    }
+
+    uint64_t count(const box3i &cells) const {
+      uint64_t result = 0;
+      for (int z=cells.lower.z; z<cells.upper.z; ++z)
+        for (int y=cells.lower.y; y<cells.upper.y; ++y)
+          for (int x=cells.lower.x; x<cells.upper.x; ++x)
+            result += histogram[linearCellID({x,y,z})];
+      return result;
+    }
+
+    // KD-split the histogram into buckets that fit in memory; the
+    // cluster budget is distributed like in MeshSplitter. Single
+    // clusters that don't fit are split on, into buckets that are
+    // merged again (see splitBuckets()). Fails if a histogram cell
+    // alone exceeds the memory budget
+    bool makeBuckets(box3i cells, unsigned numClusters, uint64_t num, bool merged) {
+      int3 size = cells.upper-cells.lower;
+      int splitAxis = 0;
+      if (size.y > size.x && size.y >= size.z)
+        splitAxis = 1;
+      else if (size.z > size.x && size.z >= size.y)
+        splitAxis = 2;
+
+      if (num <= bucketCapacity || size[splitAxis] <= 1) {
+        if (num > bucketCapacity) {
+          std::cerr << "Cannot split the mesh into buckets of at most "
+                    << bucketCapacity << " triangles (" << num
+                    << " triangles in one cell), increase -mem\n";
+          return false;
+        }
+        Bucket bucket{};
+        bucket.cellRange = cells;
+        bucket.numClusters = numClusters;
+        bucket.numTriangles = num;
+        bucket.merged = merged;
+        buckets.push_back(bucket);
+        return true;
+      }
+
+      unsigned numClustersL = numClusters > 1 ? numClusters/2 : numClusters;
+      uint64_t target = numClusters > 1 ? num*numClustersL/numClusters : num/2;
+
+      // Find the cell plane closest to the target
+      box3i slice = cells;
+      int plane = cells.lower[splitAxis]+1;
+      uint64_t numL = 0, prefix = 0;
+      uint64_t bestDist = UINT64_MAX;
+      for (int p=cells.lower[splitAxis]+1; p<cells.upper[splitAxis]; ++p) {
+        slice.lower[splitAxis] = p-1;
+        slice.upper[splitAxis] = p;
+        prefix += count(slice);
+        uint64_t dist = prefix > target ? prefix-target : target-prefix;
+        if (dist < bestDist) {
+          bestDist = dist;
+          plane = p;
+          numL = prefix;
+        }
+        if (prefix >= target)
+          break;
+      }
+
+      box3i L = cells, R = cells;
+      L.upper[splitAxis] = plane;
+      R.lower[splitAxis] = plane;
+      uint64_t numR = num-numL;
+
+      // Empty sides get no clusters
+      if (numL == 0)
+        return makeBuckets(R,numClusters,numR,merged);
+      else if (numR == 0)
+        return makeBuckets(L,numClusters,numL,merged);
+      else if (numClusters <= 1)
+        return makeBuckets(L,numClusters,numL,merged)
+            && makeBuckets(R,numClusters,numR,true);
+      else
+        return makeBuckets(L,numClustersL,numL,merged)
+            && makeBuckets(R,numClusters-numClustersL,numR,merged);
+    }
+
+    bool buildBuckets() {
+      buckets.clear();
+      if (!makeBuckets({int3(0),cellDims},numClustersDesired,numTriangles,false))
+        return false;
+
+      // Cell to bucket lookup, and the buckets' spatial extents
+      bucketIDs.resize(histogram.size());
+      float3 cellSize = bounds.size()/float3(cellDims);
+      for (size_t b=0; b<buckets.size(); ++b) {
+        Bucket &bucket = buckets[b];
+        const box3i &cells = bucket.cellRange;
+        for (int z=cells.lower.z; z<cells.upper.z; ++z)
+          for (int y=cells.lower.y; y<cells.upper.y; ++y)
+            for (int x=cells.lower.x; x<cells.upper.x; ++x)
+              bucketIDs[linearCellID({x,y,z})] = (unsigned)b;
+
+        for (int i=0; i<3; ++i) {
+          bucket.bounds.lower[i] = cells.lower[i] == 0 ? bounds.lower[i]
+              : bounds.lower[i]+cells.lower[i]*cellSize[i];
+          bucket.bounds.upper[i] = cells.upper[i] == cellDims[i] ? bounds.upper[i]
+              : bounds.lower[i]+cells.upper[i]*cellSize[i];
+        }
+        bucket.fileName = outFileName+".bucket"+std::to_string(b);
+      }
+
+      std::cout << "#buckets: " << buckets.size() << '\n';
+      return true;
+    }
+
+    // The triangles are buffered per bucket, and the buffers are
+    // appended to the bucket files with short-lived opens, so there
+    // are never more than one file open, however many buckets there
+    // are. The buffers share half of the memory budget
+    bool writeBuckets() {
+      size_t bufferSize = std::max(minScatterBufferSize,
+          memoryBudget/2/sizeof(int3)/std::max<size_t>(1,buckets.size()));
+      std::vector<std::vector<int3>> buffers(buckets.size());
+      std::vector<bool> created(buckets.size(),false);
+
+      auto flush = [&](size_t b) {
+        FILE *file = fopen(buckets[b].fileName.c_str(),created[b] ? "ab" : "wb");
+        if (!file) {
+          std::cerr << "Cannot open " << buckets[b].fileName << '\n';
+          return false;
+        }
+        created[b] = true;
+        size_t n = fwrite(buffers[b].data(),sizeof(int3),buffers[b].size(),file);
+        bool ok = fclose(file) == 0 && n == buffers[b].size();
+        if (!ok)
+          std::cerr << "Cannot write " << buckets[b].fileName << '\n';
+        buffers[b].clear();
+        return ok;
+      };
+
+      bool ok = true;
+      bool read = forEachTriangle([&](int3 tri) {
+        if (!ok || !valid(tri))
+          return;
+        unsigned b = bucketIDs[linearCellID(cellID(triangleBounds(tri).lower))];
+        buffers[b].push_back(tri);
+        if (buffers[b].size() >= bufferSize)
+          ok = flush(b);
+      });
+
+      for (size_t b=0; b<buckets.size() && ok; ++b)
+        ok = flush(b);
+
+      return read && ok;
+    }
+
+    bool splitBuckets() {
+      std::ofstream ofs(outFileName,std::ios::binary);
+      uint64_t numClusters = 0;
+      ofs.write((char *)&triFileMagic,sizeof(triFileMagic));
+      ofs.write((char *)&triFileVersion,sizeof(triFileVersion));
+      ofs.write((char *)&numClusters,sizeof(numClusters));
+      ofs.write((char *)&bounds,sizeof(bounds));
+
+      // Buckets produce at most numClustersDesired clusters in total;
+      // the directory is written at the end
+      std::vector<TriFileDirEntry> directory(numClustersDesired);
+      uint64_t directoryPos = ofs.tellp();
+      ofs.seekp(directoryPos+sizeof(TriFileDirEntry)*directory.size());
+
+      for (size_t b=0; b<buckets.size(); ) {
+        size_t last = b+1;
+        while (last < buckets.size() && buckets[last].merged)
+          last++;
+
+        if (last-b > 1) {
+          if (!writeMergedCluster(ofs,b,last,directory[numClusters]))
+            return false;
+          numClusters++;
+          b = last;
+          continue;
+        }
+
+        const Bucket &bucket = buckets[b++];
+        Mesh::SP mesh = loadBucket(bucket);
+        std::remove(bucket.fileName.c_str());
+        if (!mesh)
+          return false;
+
+        if (mesh->geoms[0]->index.empty())
+          continue;
+
+        MeshSplitter splitter(bucket.numClusters,mesh,bucket.bounds,strategy,pool);
+        splitter.writeClusters(ofs,directory.data()+numClusters);
+        numClusters += splitter.clusters.size();
+      }
+
+      ofs.seekp(directoryPos-sizeof(bounds)-sizeof(numClusters));
+      ofs.write((char *)&numClusters,sizeof(numClusters));
+      ofs.seekp(directoryPos);
+      ofs.write((char *)directory.data(),sizeof(TriFileDirEntry)*numClusters);
+
+      std::cout << "#clusters: " << numClusters << '\n';
+      return true;
+    }
+
+    // Write buckets [first,last) as a single cluster, loading one
+    // bucket at a time. The vertices of each bucket are compacted on
+    // their own (vertices on the buckets' borders are duplicated);
+    // the indices are staged in a scratch file, as they follow all of
+    // the cluster's vertices
+    bool writeMergedCluster(std::ostream &ofs,
+                            size_t first,
+                            size_t last,
+                            TriFileDirEntry &entry) {
+      std::string indexFileName = outFileName+".indices";
+      std::fstream indexFile(indexFileName,
+          std::ios::binary|std::ios::in|std::ios::out|std::ios::trunc);
+      if (!indexFile.good()) {
+        std::cerr << "Cannot open " << indexFileName << '\n';
+        return false;
+      }
+
+      entry.offset = ofs.tellp();
+      entry.numVerts = 0;
+      entry.numIndices = 0;
+      entry.domain = { float3(FLT_MAX), float3(-FLT_MAX) };
+
+      bool ok = true;
+      for (size_t b=first; b<last; ++b) {
+        Mesh::SP mesh = ok ? loadBucket(buckets[b]) : nullptr;
+        std::remove(buckets[b].fileName.c_str());
+        if (!mesh) {
+          ok = false;
+          continue;
+        }
+
+        Geometry::SP geom = mesh->geoms[0];
+        for (auto &tri : geom->index)
+          tri = tri+int3((int)entry.numVerts);
+        ofs.write((char *)geom->vertex.data(),sizeof(float3)*geom->vertex.size());
+        indexFile.write((char *)geom->index.data(),sizeof(int3)*geom->index.size());
+
+        entry.numVerts += geom->vertex.size();
+        entry.numIndices += geom->index.size();
+        entry.domain.extend(buckets[b].bounds);
+      }
+
+      // Append the indices
+      std::vector<char> chunk(size_t(1)<<20);
+      indexFile.seekg(0);
+      uint64_t remaining = sizeof(int3)*entry.numIndices;
+      while (ok && remaining > 0) {
+        size_t n = (size_t)std::min<uint64_t>(chunk.size(),remaining);
+        indexFile.read(chunk.data(),n);
+        ofs.write(chunk.data(),n);
+        remaining -= n;
+        ok = indexFile.good();
+      }
+
+      indexFile.close();
+      std::remove(indexFileName.c_str());
+
+      if (!ok || !ofs.good()) {
+        std::cerr << "Cannot write merged cluster to " << outFileName << '\n';
+        return false;
+      }
+
+      entry.numBytes = sizeof(float3)*entry.numVerts+sizeof(int3)*entry.numIndices;
+      return true;
+    }
+
+    Mesh::SP loadBucket(const Bucket &bucket) {
+      std::ifstream in(bucket.fileName,std::ios::binary);
+      if (!in.good()) {
+        std::cerr << "Cannot open " << bucket.fileName << '\n';
+        return nullptr;
+      }
+
+      Geometry::SP geom = std::make_shared<Geometry>();
+      geom->index.resize(bucket.numTriangles);
+      in.read((char *)geom->index.data(),sizeof(int3)*geom->index.size());
+
+      // Compact the vertices to the ones this bucket references
+      std::unordered_map<int,int> remap;
+      auto local = [&](int index) {
+        auto it = remap.find(index);
+        if (it != remap.end())
+          return it->second;
+        int l = (int)geom->vertex.size();
+        remap[index] = l;
+        geom->vertex.push_back(vertices[index]);
+        return l;
+      };
+      for (auto &tri : geom->index)
+        tri = int3(local(tri.x),local(tri.y),local(tri.z));
+
+      Mesh::SP mesh = std::make_shared<Mesh>();
+      mesh->bounds = bucket.bounds;
+      mesh->geoms.push_back(geom);
+      return mesh;
+    }
+
+    unsigned numClustersDesired;
+    std::string inFileName;
+    std::string outFileName;
+    std::string vertexFileName;
+    Strategy strategy;
+    ThreadPool &pool;
+
+    size_t memoryBudget;
+    size_t bucketCapacity;
+
+    box3 bounds;
+    int64_t numVertices = 0;
+    uint64_t numTriangles = 0;
+    std::unique_ptr<FileMapping> vertexFile;
+    const float3 *vertices = nullptr;
+
+    int3 cellDims;
+    std::vector<uint64_t> histogram;
+    std::vector<unsigned> bucketIDs;
+    std::vector<Bucket> buckets;
   };
 
   /* Volume splitter. Splits volumes into raw files, with domain and cellRange headers */
@@ -261,13 +1186,22 @@ namespace util {
       box3 spaceRange;
     };
 
-    VolumeSplitter(unsigned numClusters, const Volume::SP& volume)
+    VolumeSplitter(unsigned numClusters,
+                   const Volume::SP& volume,
+                   int ghostWidth,
+                   int macrocellSize,
+                   BrickCodec codec,
+                   ThreadPool &pool)
       : numClustersDesired(numClusters)
       , volume(volume)
+      , ghostWidth(ghostWidth)
+      , macrocellSize(macrocellSize)
+      , codec(codec)
+      , pool(pool)
     {
       Domain domain;
       domain.cellRange = box3i{{0,0,0},volume->dims};
-      domain.voxelRange = box3i{{0,0,0},int3(volume->dims+1)};
+      domain.voxelRange = voxelRangeOf(domain.cellRange);
       domain.spaceRange = box3{{0.f,0.f,0.f},float3(volume->dims)};
 
       cellRange = domain.cellRange;
@@ -283,6 +1217,16 @@ namespace util {
       }
     }
 
+    // Voxels needed to sample the cells: the cells' corners (i.e., up
+    // to the neighbors' first voxel layer), plus ghostWidth layers on
+    // each side, e.g., for gradients at the brick boundaries
+    box3i voxelRangeOf(const box3i &cells) const {
+      box3i voxels;
+      voxels.lower = max(cells.lower-int3(ghostWidth),int3(0));
+      voxels.upper = min(cells.upper+int3(1+ghostWidth),volume->dims);
+      return voxels;
+    }
+
     void doSplit() {
       Domain domain;
 
@@ -318,16 +1262,14 @@ namespace util {
       Domain L;
       L.cellRange = domain.cellRange;
       L.cellRange.upper[splitAxis] = splitPlane;
-      L.voxelRange.lower = L.cellRange.lower;
-      L.voxelRange.upper = min(L.cellRange.upper+1,volume->dims);
+      L.voxelRange = voxelRangeOf(L.cellRange);
       L.spaceRange.lower = float3(L.cellRange.lower);
       L.spaceRange.upper = float3(L.cellRange.upper);
 
       Domain R;
       R.cellRange = domain.cellRange;
       R.cellRange.lower[splitAxis] = splitPlane;
-      R.voxelRange.lower = R.cellRange.lower;
-      R.voxelRange.upper = min(R.cellRange.upper+1,volume->dims);
+      R.voxelRange = voxelRangeOf(R.cellRange);
       R.spaceRange.lower = float3(R.cellRange.lower);
       R.spaceRange.upper = float3(R.cellRange.upper);
 
@@ -341,34 +1283,171 @@ namespace util {
         doSplit();
     }
 
-    void saveVols(const std::string& fn) {
+    // Bricks are extracted and encoded concurrently, in batches, as
+    // their stored sizes (and hence their offsets) are only known after
+    // encoding; the directory and the macrocells are written last. The
+    // file is the same as if written serially. If any write fails, the
+    // partial file is removed
+    bool saveVols(const std::string& fn) {
       uint64_t numClusters = clusters.size();
-      // uint64_t numVerts = mesh->geoms[0]->vertex.size();
 
-      std::ofstream ofs(fn,std::ios::binary);
-      ofs.write((char *)&numClusters,sizeof(numClusters));
-      ofs.write((char *)&cellRange,sizeof(cellRange));
-      ofs.write((char *)&voxelRange,sizeof(voxelRange));
-      ofs.write((char *)&spaceRange,sizeof(spaceRange));
+      const size_t headerSize = sizeof(volFileMagic)+sizeof(volFileVersion)
+                              + sizeof(numClusters)+sizeof(cellRange)
+                              + sizeof(voxelRange)+sizeof(spaceRange)
+                              + sizeof(int64_t)*2;
+
+      OutFile out(fn);
+      if (!out.good()) {
+        std::cerr << "Cannot open " << fn << '\n';
+        return false;
+      }
+
+      std::vector<char> header(headerSize);
+      char *p = header.data();
+      p = put(p,volFileMagic);
+      p = put(p,volFileVersion);
+      p = put(p,numClusters);
+      p = put(p,cellRange);
+      p = put(p,voxelRange);
+      p = put(p,spaceRange);
+      p = put(p,int64_t(ghostWidth));
+      p = put(p,int64_t(macrocellSize));
+      std::atomic<bool> written{out.writeAt(header.data(),header.size(),0)};
+
+      // The macrocells' sizes are known upfront, so the brick data
+      // starts right after them
+      std::vector<size_t> firstMacrocell(clusters.size()+1,0);
+      for (unsigned i=0; i<clusters.size(); ++i) {
+        int3 voxelRange = clusters[i].voxelRange.upper-clusters[i].voxelRange.lower;
+        int3 mcDims = macrocellDims(voxelRange,macrocellSize);
+        firstMacrocell[i+1] = firstMacrocell[i]+mcDims.x*size_t(mcDims.y)*mcDims.z;
+      }
+
+      std::vector<VolFileDirEntry> directory(clusters.size());
+      std::vector<box1> macrocells(firstMacrocell.back());
+
+      const uint32_t bpc = volume->bpc;
+      size_t offset = headerSize+sizeof(VolFileDirEntry)*directory.size()
+                    + sizeof(box1)*macrocells.size();
+      size_t rawBytes = 0, totalStoredBytes = 0;
+
+      const unsigned batchSize = pool.size()*2;
+      std::vector<std::vector<char>> buffers(batchSize);
+
+      for (unsigned first=0; first<clusters.size() && written; first+=batchSize)
+      {
+        unsigned last = std::min(first+batchSize,(unsigned)clusters.size());
+
+        // Extract and encode
+        ThreadPool::TaskGroup encodeGroup;
+        for (unsigned i=first; i<last; ++i)
+        {
+          pool.spawn(encodeGroup, [this,i,first,bpc,&buffers,&directory,
+                                   &macrocells,&firstMacrocell]() {
+            static thread_local std::vector<char> voxels;
+            static thread_local std::vector<float> normalized;
+            static thread_local std::vector<uint8_t> encoded;
+
+            Domain domain = clusters[i];
+            int3 voxelRange = domain.voxelRange.upper-domain.voxelRange.lower;
+            size_t numVoxels = voxelRange.x * size_t(voxelRange.y) * voxelRange.z;
+            size_t numBytes = bpc*numVoxels;
+            voxels.resize(numBytes);
+
+            box1 valueRange{FLT_MAX,-FLT_MAX};
+            volume->getNative(domain.voxelRange.lower,domain.voxelRange.upper,
+                              voxels.data(),&valueRange);
+
+            normalized.resize(numVoxels);
+            Volume::toFloat(voxels.data(),bpc,normalized.data(),numVoxels);
+            computeMacrocells(normalized.data(),voxelRange,macrocellSize,
+                              macrocells.data()+firstMacrocell[i]);
+
+            BrickCodec brickCodec = codec;
+            if (!encodeBrick(codec,bpc,voxels.data(),numBytes,encoded))
+              brickCodec = BrickCodec::None;
+
+            const char *data = brickCodec == BrickCodec::None
+                ? voxels.data() : (const char *)encoded.data();
+            uint64_t storedBytes = brickCodec == BrickCodec::None
+                ? numBytes : encoded.size();
+
+            buffers[i-first].assign(data,data+storedBytes);
+
+            VolFileDirEntry &e = directory[i];
+            e.cellRange = domain.cellRange;
+            e.voxelRange = domain.voxelRange;
+            e.spaceRange = domain.spaceRange;
+            e.valueRange = valueRange;
+            e.bpc = bpc;
+            e.codec = (uint32_t)brickCodec;
+            e.storedBytes = storedBytes;
+          });
+        }
+        pool.wait(encodeGroup);
+
+        for (unsigned i=first; i<last; ++i)
+        {
+          directory[i].offset = offset;
+          offset += directory[i].storedBytes;
+          int3 voxelRange = clusters[i].voxelRange.upper-clusters[i].voxelRange.lower;
+          rawBytes += bpc*(voxelRange.x * size_t(voxelRange.y) * voxelRange.z);
+          totalStoredBytes += directory[i].storedBytes;
+        }
+
+        // Write
+        ThreadPool::TaskGroup writeGroup;
+        for (unsigned i=first; i<last; ++i)
+        {
+          pool.spawn(writeGroup, [i,first,&buffers,&directory,&out,&written]() {
+            const std::vector<char> &buffer = buffers[i-first];
+            if (!out.writeAt(buffer.data(),buffer.size(),directory[i].offset))
+              written = false;
+          });
+        }
+        pool.wait(writeGroup);
+      }
+
+      if (!written
+       || !out.writeAt(directory.data(),
+                       sizeof(VolFileDirEntry)*directory.size(),
+                       headerSize)
+       || !out.writeAt(macrocells.data(),
+                       sizeof(box1)*macrocells.size(),
+                       headerSize+sizeof(VolFileDirEntry)*directory.size())) {
+        std::cerr << "Cannot write " << fn << '\n';
+        out.close();
+        std::remove(fn.c_str());
+        return false;
+      }
 
       for (unsigned i=0; i<clusters.size(); ++i)
       {
-        Domain domain = clusters[i];
-        int3 voxelRange = domain.voxelRange.upper-domain.voxelRange.lower;
-        size_t numVoxels = voxelRange.x * size_t(voxelRange.y) * voxelRange.z;
-        box1 valueRange{FLT_MAX,-FLT_MAX};
-        const float *voxels = volume->get(domain.voxelRange,&valueRange);
-        ofs.write((char *)&domain.cellRange,sizeof(domain.cellRange));
-        ofs.write((char *)&domain.voxelRange,sizeof(domain.voxelRange));
-        ofs.write((char *)&domain.spaceRange,sizeof(domain.spaceRange));
-        ofs.write((char *)&valueRange,sizeof(valueRange));
-        ofs.write((char*)voxels,sizeof(float)*numVoxels);
-        std::cout << i << ' ' << valueRange << '\n';
+        std::cout << i << ' ' << directory[i].valueRange << '\n';
+      }
+
+      if (codec != BrickCodec::None) {
+        std::cout << "Voxel data: " << rawBytes << " bytes, stored: "
+                  << totalStoredBytes
+                  << " bytes\n";
       }
+
+      return true;
+    }
+
+    template <typename T>
+    static char *put(char *dst, const T &value)
+    {
+      memcpy(dst,&value,sizeof(value));
+      return dst+sizeof(value);
     }
 
     unsigned numClustersDesired;
     Volume::SP volume;
+    int ghostWidth;
+    int macrocellSize;
+    BrickCodec codec;
+    ThreadPool &pool;
     Mesh::SP mesh;
     box3i cellRange;
     box3i voxelRange;
@@ -381,25 +1460,65 @@ namespace util {
   {
     for (int i=1;i<argc;i++) {
       const std::string arg = argv[i];
+      // value of an option
+      auto next = [&]() {
+        if (i+1 >= argc)
+          usage("missing value for '"+arg+"'");
+        return argv[++i];
+      };
       if (arg[0] != '-') {
         cmdline.inFileName = arg;
       }
       else if (arg == "-o") {
-        cmdline.outFileName = argv[++i];
+        cmdline.outFileName = next();
       }
       else if (arg == "-n") {
-        cmdline.numClusters = std::atoi(argv[++i]);
+        cmdline.numClusters = std::atoi(next());
+      }
+      else if (arg == "-strategy") {
+        const std::string strategy = next();
+        if (strategy == "middle")
+          cmdline.strategy = Strategy::Middle;
+        else if (strategy == "median")
+          cmdline.strategy = Strategy::Median;
+        else if (strategy == "binned")
+          cmdline.strategy = Strategy::Binned;
+        else
+          usage("wrong strategy '"+strategy+"'");
+      }
+      else if (arg == "-stream") {
+        cmdline.stream = true;
+      }
+      else if (arg == "-mem") {
+        cmdline.memoryBudget = size_t(std::stoul(next()))<<20;
+      }
+      else if (arg == "-threads") {
+        cmdline.numThreads = std::atoi(next());
       }
       else if (arg == "-dims") {
-        cmdline.volume.dims.x = std::stoi(argv[++i]);
-        cmdline.volume.dims.y = std::stoi(argv[++i]);
-        cmdline.volume.dims.z = std::stoi(argv[++i]);
+        cmdline.volume.dims.x = std::stoi(next());
+        cmdline.volume.dims.y = std::stoi(next());
+        cmdline.volume.dims.z = std::stoi(next());
       }
       else if (arg == "-bpc") {
-        cmdline.volume.bpc = std::stoi(argv[++i]);
+        cmdline.volume.bpc = std::stoi(next());
+      }
+      else if (arg == "-ghost") {
+        cmdline.volume.ghostWidth = std::max(0,std::stoi(next()));
+      }
+      else if (arg == "-macrocell") {
+        cmdline.volume.macrocellSize = std::max(1,std::stoi(next()));
+      }
+      else if (arg == "-compress") {
+        cmdline.volume.compress = true;
+      }
+      else if (arg == "-bricked") {
+        cmdline.volume.brickSize = 32;
+        if (i+1 < argc && argv[i+1][0] != '-')
+          cmdline.volume.brickSize = std::stoi(next());
       }
       else if (arg == "-type") {
-        const std::string type = argv[++i];
+        const std::string type = next();
         if (type == "uint8")
           cmdline.volume.bpc = 1;
         else if (type == "uint16")
@@ -418,7 +1537,18 @@ namespace util {
 
     box3 modelBounds = { float3(1e30f), float3(-1e30f) };
 
-    if (getExt(cmdline.inFileName)==".obj") {
+    if (getExt(cmdline.inFileName)==".obj" && cmdline.stream) {
+      ThreadPool pool(cmdline.numThreads > 0 ? cmdline.numThreads
+                                             : std::thread::hardware_concurrency());
+      StreamingMeshSplitter splitter(cmdline.numClusters,
+                                     cmdline.inFileName,
+                                     cmdline.outFileName,
+                                     cmdline.memoryBudget,
+                                     cmdline.strategy,
+                                     pool);
+      if (!splitter.run())
+        return 1;
+    } else if (getExt(cmdline.inFileName)==".obj") {
       Mesh::SP objMesh;
       try {
         objMesh = Mesh::load(cmdline.inFileName);
@@ -430,29 +1560,65 @@ namespace util {
              modelBounds.extend(v);
           }
         }
-        // Push onto geometry stack
-        for (std::size_t i=0; i<objMesh->geoms.size(); ++i)
+        // MeshSplitter expects a single geom, merge the shapes
+        if (objMesh->geoms.size() > 1)
         {
-          Geometry::SP &geom = objMesh->geoms[i];
+          Geometry::SP merged = std::make_shared<Geometry>();
+          for (std::size_t i=0; i<objMesh->geoms.size(); ++i)
+          {
+            const Geometry::SP &geom = objMesh->geoms[i];
+            int offset = (int)merged->vertex.size();
+            merged->vertex.insert(merged->vertex.end(),geom->vertex.begin(),geom->vertex.end());
+            for (const auto &idx : geom->index) {
+              merged->index.push_back(idx+int3(offset));
+            }
+          }
+          objMesh->geoms = {merged};
         }
       } catch (...) { std::cerr << "Cannot load..\n"; }
 
-      MeshSplitter splitter(cmdline.numClusters,objMesh,modelBounds);
+      ThreadPool pool(cmdline.numThreads > 0 ? cmdline.numThreads
+                                             : std::thread::hardware_concurrency());
+      MeshSplitter splitter(cmdline.numClusters,objMesh,modelBounds,cmdline.strategy,pool);
 
       splitter.saveTris(cmdline.outFileName);
-    } else if (getExt(cmdline.inFileName) == ".raw") {
-      if (cmdline.volume.dims == int3(0))
-        usage("no input dimensions specified");
-      else if (cmdline.volume.bpc == 0)
-        usage("no data type/bpc specified");
-
-      Volume::SP volume = std::make_shared<Volume>(cmdline.inFileName,
-                                                   cmdline.volume.dims,
-                                                   cmdline.volume.bpc);
+    } else if (getExt(cmdline.inFileName) == ".raw"
+            || getExt(cmdline.inFileName) == ".bvol") {
+      Volume::SP volume;
+      if (getExt(cmdline.inFileName) == ".raw") {
+        if (cmdline.volume.dims == int3(0))
+          usage("no input dimensions specified");
+        else if (cmdline.volume.bpc == 0)
+          usage("no data type/bpc specified");
+
+        volume = std::make_shared<Volume>(cmdline.inFileName,
+                                          cmdline.volume.dims,
+                                          cmdline.volume.bpc);
+      } else {
+        volume = std::make_shared<Volume>(cmdline.inFileName);
+        if (volume->dims == int3(0))
+          usage("'"+cmdline.inFileName+"' is not a bricked volume");
+      }
 
-      VolumeSplitter splitter(cmdline.numClusters,volume);
+      if (cmdline.volume.brickSize > 0) {
+        if (!volume->saveBricked(cmdline.outFileName,cmdline.volume.brickSize)) {
+          std::cerr << "Cannot write " << cmdline.outFileName << '\n';
+          return 1;
+        }
+        return 0;
+      }
 
-      splitter.saveVols(cmdline.outFileName);
+      ThreadPool pool(cmdline.numThreads > 0 ? cmdline.numThreads
+                                             : std::thread::hardware_concurrency());
+      VolumeSplitter splitter(cmdline.numClusters,
+                              volume,
+                              cmdline.volume.ghostWidth,
+                              cmdline.volume.macrocellSize,
+                              cmdline.volume.compress ? BrickCodec::LZ : BrickCodec::None,
+                              pool);
+
+      if (!splitter.saveVols(cmdline.outFileName))
+        return 1;
     }
 
     return 0;
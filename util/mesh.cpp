@@ -15,16 +15,30 @@
 // ======================================================================== //
 
 #include <string.h>
-
-#define TINYOBJLOADER_IMPLEMENTATION
-#include "tiny_obj_loader.h"
+#include <algorithm>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <stdexcept>
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#include <process.h>
+#include <sys/stat.h>
+#define getpid _getpid
+#else
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 #ifdef USE_MINI
 #include <miniScene/Scene.h>
 #include <miniScene/Serialized.h>
 #endif
 
+#include "FileMapping.h"
 #include "mesh.h"
+#include "ThreadPool.h"
 
 namespace util {
 
@@ -36,51 +50,239 @@ namespace util {
     return fileName.substr(pos);
   }
 
+  // ==================================================================
+  // OBJ import. The file is mapped into memory and split into chunks
+  // at line boundaries that are tokenized in parallel; only v, f, o
+  // and g statements are considered. Each shape (o/g) becomes one
+  // geometry with its own, compacted vertex array
+  // ==================================================================
+
+  struct OBJChunk {
+    const char *begin, *end;
+    std::vector<float3> vertices;
+    std::vector<int3> faces;
+    // Corners (face*3+i) with negative indices; these are stored
+    // relative to the chunk's first vertex until the offsets are known
+    std::vector<size_t> relativeCorners;
+    // Local face IDs where new shapes start
+    std::vector<size_t> shapeStarts;
+    // Indices of the current face, and if they are relative
+    std::vector<std::pair<int,bool>> face;
+  };
+
+  inline bool isBlank(char c)
+  { return c == ' ' || c == '\t' || c == '\r'; }
+
+  inline const char *skipBlanks(const char *p, const char *end)
+  {
+    while (p < end && isBlank(*p))
+      ++p;
+    return p;
+  }
+
+  // [begin,end) is a line without the newline; the byte at *end must
+  // be readable (newline, or a terminating zero)
+  static void parseOBJLine(OBJChunk &chunk, const char *begin, const char *end)
+  {
+    const char *p = skipBlanks(begin,end);
+    if (end-p < 2 || !isBlank(p[1]))
+      return;
+
+    if (p[0] == 'v') {
+      float v[3] = {0.f,0.f,0.f};
+      p += 2;
+      for (int i=0; i<3; ++i) {
+        p = skipBlanks(p,end);
+        if (p >= end)
+          break;
+        char *next;
+        v[i] = strtof(p,&next);
+        p = next;
+      }
+      chunk.vertices.push_back({v[0],v[1],v[2]});
+    } else if (p[0] == 'f') {
+      chunk.face.clear();
+      p += 2;
+      while (true) {
+        p = skipBlanks(p,end);
+        if (p >= end)
+          break;
+        char *next;
+        long i = strtol(p,&next,10);
+        if (next == p)
+          break;
+        if (i < 0)
+          chunk.face.push_back({int((long)chunk.vertices.size()+i),true});
+        else
+          chunk.face.push_back({int(i-1),false});
+        // skip texcoord/normal indices
+        p = next;
+        while (p < end && !isBlank(*p))
+          ++p;
+      }
+
+      // Triangulate polygons as fans
+      for (size_t i=2; i<chunk.face.size(); ++i) {
+        const std::pair<int,bool> corners[3] = {
+          chunk.face[0], chunk.face[i-1], chunk.face[i]
+        };
+        for (int c=0; c<3; ++c) {
+          if (corners[c].second)
+            chunk.relativeCorners.push_back(chunk.faces.size()*3+c);
+        }
+        chunk.faces.push_back({corners[0].first,corners[1].first,corners[2].first});
+      }
+    } else if (p[0] == 'o' || p[0] == 'g') {
+      chunk.shapeStarts.push_back(chunk.faces.size());
+    }
+  }
+
+  static void parseOBJChunk(OBJChunk &chunk, const char *fileEnd)
+  {
+    const char *p = chunk.begin;
+    while (p < chunk.end) {
+      const char *eol = (const char *)memchr(p,'\n',chunk.end-p);
+      if (!eol) {
+        if (chunk.end == fileEnd) {
+          // Last line w/o newline; copy so the parser can't read
+          // past the end of the mapping
+          std::string line(p,chunk.end);
+          parseOBJLine(chunk,line.c_str(),line.c_str()+line.size());
+          break;
+        }
+        eol = chunk.end;
+      }
+      parseOBJLine(chunk,p,eol);
+      p = eol+1;
+    }
+  }
+
   Mesh::SP Mesh::loadOBJ(std::string objFileName) {
     Mesh::SP res = std::make_shared<Mesh>();
 
-    tinyobj::attrib_t attrib;
-    std::vector<tinyobj::shape_t> shapes;
-    std::vector<tinyobj::material_t> materials;
-    std::string err = "";
-
-    std::string modelDir = objFileName.substr(0, objFileName.rfind('/') + 1);
-
-    bool readOK
-      = tinyobj::LoadObj(&attrib,
-                        &shapes,
-                        &materials,
-                        &err,
-                        &err,
-                        objFileName.c_str(),
-                        modelDir.c_str(),
-                        /* triangulate */true,
-                        /* default vertex colors fallback*/ false);
-
-    if (!readOK)
-      throw std::runtime_error("Could not read OBJ model from " + objFileName + " : " + err);
-
-    for (int shapeID = 0; shapeID < (int)shapes.size(); shapeID++) {
-      tinyobj::shape_t& shape = shapes[shapeID];
-      Geometry::SP geom = std::make_shared<Geometry>();
-      // Just lazily copy _all_ the vertices into this geom..
-      for (std::size_t i=0; i<attrib.vertices.size(); i+=3) {
-        float *v = attrib.vertices.data() + i;
-        geom->vertex.push_back({v[0],v[1],v[2]});
-      }
-      for (int faceID = 0; faceID < shape.mesh.material_ids.size(); faceID++) {
-        if (shape.mesh.num_face_vertices[faceID] != 3)
-          throw std::runtime_error("not properly tessellated"); // while this would actually be rather easy...
-        tinyobj::index_t idx0 = shape.mesh.indices[3*faceID];
-        tinyobj::index_t idx1 = shape.mesh.indices[3*faceID+1];
-        tinyobj::index_t idx2 = shape.mesh.indices[3*faceID+2];
-        geom->index.push_back({idx0.vertex_index,
-                               idx1.vertex_index,
-                               idx2.vertex_index});
+    FileMapping file(objFileName);
+    const char *data = (const char *)file.data();
+    const char *dataEnd = data+file.nbytes();
+
+    ThreadPool pool;
+
+    // Split into chunks at line boundaries
+    const size_t minChunkSize = 1<<20;
+    size_t numChunks = std::max<size_t>(1,std::min<size_t>(
+        pool.size()*8,file.nbytes()/minChunkSize));
+    std::vector<OBJChunk> chunks(numChunks);
+    const char *p = data;
+    for (size_t i=0; i<numChunks; ++i) {
+      chunks[i].begin = p;
+      if (i == numChunks-1) {
+        p = dataEnd;
+      } else {
+        p = std::max(p,data+file.nbytes()*(i+1)/numChunks);
+        const char *eol = (const char *)memchr(p,'\n',dataEnd-p);
+        p = eol ? eol+1 : dataEnd;
       }
-      res->geoms.push_back(geom);
+      chunks[i].end = p;
+    }
+
+    ThreadPool::TaskGroup group;
+    for (auto &chunk : chunks) {
+      OBJChunk *c = &chunk;
+      pool.spawn(group, [c,dataEnd]() { parseOBJChunk(*c,dataEnd); });
+    }
+    pool.wait(group);
+
+    // Concatenate the vertices, and the faces with the shape breaks
+    size_t numVertices = 0, numFaces = 0;
+    std::vector<size_t> shapeStarts;
+    for (auto &chunk : chunks) {
+      for (auto corner : chunk.relativeCorners)
+        chunk.faces[corner/3][corner%3] += (int)numVertices;
+      for (auto start : chunk.shapeStarts)
+        shapeStarts.push_back(numFaces+start);
+      numVertices += chunk.vertices.size();
+      numFaces += chunk.faces.size();
+    }
+
+    std::vector<float3> vertices(numVertices);
+    std::vector<int3> faces(numFaces);
+    size_t vertexOffset = 0, faceOffset = 0;
+    for (auto &chunk : chunks) {
+      OBJChunk *c = &chunk;
+      pool.spawn(group, [c,&vertices,&faces,vertexOffset,faceOffset]() {
+        std::copy(c->vertices.begin(),c->vertices.end(),vertices.begin()+vertexOffset);
+        std::copy(c->faces.begin(),c->faces.end(),faces.begin()+faceOffset);
+        std::vector<float3>().swap(c->vertices);
+        std::vector<int3>().swap(c->faces);
+      });
+      vertexOffset += chunk.vertices.size();
+      faceOffset += chunk.faces.size();
+    }
+    pool.wait(group);
+
+    for (auto &f : faces) {
+      if (f.x < 0 || (size_t)f.x >= numVertices
+       || f.y < 0 || (size_t)f.y >= numVertices
+       || f.z < 0 || (size_t)f.z >= numVertices)
+        throw std::runtime_error("Invalid vertex index in OBJ model " + objFileName);
+    }
+
+    // Shapes w/o faces are dropped
+    std::vector<std::pair<size_t,size_t>> shapes;
+    shapeStarts.push_back(numFaces);
+    size_t first = 0;
+    for (auto start : shapeStarts) {
+      if (start > first)
+        shapes.push_back({first,start});
+      first = std::max(first,start);
     }
 
+    res->bounds = { float3(1e30f), float3(-1e30f) };
+    for (auto &v : vertices)
+      res->bounds.extend(v);
+
+    res->geoms.resize(shapes.size());
+
+    if (shapes.size() == 1 && shapes[0].first == 0) {
+      // Common case, no compaction needed
+      res->geoms[0] = std::make_shared<Geometry>();
+      res->geoms[0]->vertex.swap(vertices);
+      res->geoms[0]->index.swap(faces);
+      return res;
+    }
+
+    for (size_t s=0; s<shapes.size(); ++s) {
+      pool.spawn(group, [&,s]() {
+        Geometry::SP geom = std::make_shared<Geometry>();
+        size_t first = shapes[s].first, last = shapes[s].second;
+
+        // Compact the vertices referenced by this shape
+        std::vector<int> used;
+        used.reserve((last-first)*3);
+        for (size_t i=first; i<last; ++i) {
+          used.push_back(faces[i].x);
+          used.push_back(faces[i].y);
+          used.push_back(faces[i].z);
+        }
+        std::sort(used.begin(),used.end());
+        used.erase(std::unique(used.begin(),used.end()),used.end());
+
+        geom->vertex.resize(used.size());
+        for (size_t i=0; i<used.size(); ++i)
+          geom->vertex[i] = vertices[used[i]];
+
+        auto local = [&](int index) {
+          return int(std::lower_bound(used.begin(),used.end(),index)-used.begin());
+        };
+        geom->index.resize(last-first);
+        for (size_t i=first; i<last; ++i) {
+          geom->index[i-first] = {local(faces[i].x),local(faces[i].y),local(faces[i].z)};
+        }
+
+        res->geoms[s] = geom;
+      });
+    }
+    pool.wait(group);
+
     return res;
   }
 
@@ -118,6 +320,9 @@ namespace util {
                 << ", #indices: " << mesh->indices.size() << '\n';
     }
     res->geoms.push_back(geom);
+    res->bounds = { float3(1e30f), float3(-1e30f) };
+    for (auto &v : geom->vertex)
+      res->bounds.extend(v);
     std::cout << "num *unique* meshes\t: "    << (numUniqueMeshes) << std::endl;
     std::cout << "num *unique* triangles\t: " << (numUniqueTriangles) << std::endl;
     std::cout << "num *unique* vertices\t: "  << (numUniqueVertices) << std::endl;
@@ -127,12 +332,213 @@ namespace util {
 #endif
   }
 
+  // ==================================================================
+  // Binary mesh cache, written next to the source file on first load:
+  //   uint64 magic, uint64 version,
+  //   uint64 sourceSize, int64 sourceTime, box3 bounds,
+  //   uint64 numGeoms, uint64 checksum,
+  //   per geom: uint64 numVerts, uint64 numIndices,
+  //   per geom: float3 vertex[numVerts], int3 index[numIndices]
+  // The cache is only used if the source's size and mtime match, and
+  // the checksum of the arrays following the header matches
+  // ==================================================================
+
+  static const uint64_t meshCacheMagic = 0x4853454d59455553ull; // "SUEYMESH"
+  static const uint64_t meshCacheVersion = 2;
+
+  struct MeshCacheHeader {
+    uint64_t magic;
+    uint64_t version;
+    uint64_t sourceSize;
+    int64_t sourceTime;
+    box3 bounds;
+    uint64_t numGeoms;
+    uint64_t checksum;
+  };
+
+  // FNV-1a over 64-bit words (and the remaining bytes); arrays are
+  // hashed one after another, passing on h
+  static uint64_t checksum(const void *data, size_t n, uint64_t h = 0xcbf29ce484222325ull)
+  {
+    const uint64_t prime = 0x100000001b3ull;
+    const uint8_t *p = (const uint8_t *)data;
+    for (; n >= sizeof(uint64_t); n -= sizeof(uint64_t), p += sizeof(uint64_t)) {
+      uint64_t word;
+      memcpy(&word,p,sizeof(word));
+      h = (h^word)*prime;
+    }
+    for (; n > 0; --n, ++p)
+      h = (h^*p)*prime;
+    return h;
+  }
+
+  static std::string cacheFileName(const std::string &fileName)
+  { return fileName+".meshcache"; }
+
+  static bool sourceStamp(const std::string &fileName, uint64_t &size, int64_t &time)
+  {
+    std::error_code ec;
+    size = std::filesystem::file_size(fileName,ec);
+    if (ec)
+      return false;
+    time = std::filesystem::last_write_time(fileName,ec).time_since_epoch().count();
+    return !ec;
+  }
+
+  static Mesh::SP loadCache(const std::string &fileName)
+  {
+    uint64_t size;
+    int64_t time;
+    std::error_code ec;
+    if (!sourceStamp(fileName,size,time)
+     || !std::filesystem::exists(cacheFileName(fileName),ec))
+      return nullptr;
+
+    try {
+      FileMapping file(cacheFileName(fileName));
+      const uint8_t *data = file.data();
+      const uint8_t *end = data+file.nbytes();
+
+      MeshCacheHeader header;
+      if (file.nbytes() < sizeof(header))
+        return nullptr;
+      memcpy(&header,data,sizeof(header));
+      if (header.magic != meshCacheMagic
+       || header.version != meshCacheVersion
+       || header.sourceSize != size
+       || header.sourceTime != time)
+        return nullptr;
+
+      const uint8_t *p = data+sizeof(header);
+      if (size_t(end-p) < sizeof(uint64_t)*2*header.numGeoms)
+        return nullptr;
+      std::vector<uint64_t> sizes(2*header.numGeoms);
+      memcpy(sizes.data(),p,sizeof(uint64_t)*sizes.size());
+      uint64_t h = checksum(p,sizeof(uint64_t)*sizes.size());
+      p += sizeof(uint64_t)*sizes.size();
+
+      Mesh::SP res = std::make_shared<Mesh>();
+      res->bounds = header.bounds;
+      for (size_t i=0; i<header.numGeoms; ++i) {
+        size_t vertexBytes = sizeof(float3)*sizes[2*i];
+        size_t indexBytes = sizeof(int3)*sizes[2*i+1];
+        if (size_t(end-p) < vertexBytes+indexBytes)
+          return nullptr;
+
+        Geometry::SP geom = std::make_shared<Geometry>();
+        geom->vertex.resize(sizes[2*i]);
+        geom->index.resize(sizes[2*i+1]);
+        memcpy(geom->vertex.data(),p,vertexBytes);
+        h = checksum(p,vertexBytes,h);
+        p += vertexBytes;
+        memcpy(geom->index.data(),p,indexBytes);
+        h = checksum(p,indexBytes,h);
+        p += indexBytes;
+        res->geoms.push_back(geom);
+      }
+
+      if (h != header.checksum)
+        return nullptr;
+
+      return res;
+    } catch (...) {
+      return nullptr;
+    }
+  }
+
+  // Atomically create a file that didn't exist before, named prefix
+  // plus a unique suffix; returns the name, or "" on failure
+  static std::string createTempFile(const std::string &prefix)
+  {
+#ifdef _WIN32
+    std::string name = prefix+std::to_string(getpid())+"XXXXXX";
+    if (_mktemp_s(&name[0],name.size()+1) != 0)
+      return "";
+    int fd = _open(name.c_str(),_O_CREAT|_O_EXCL|_O_WRONLY|_O_BINARY,
+                   _S_IREAD|_S_IWRITE);
+    if (fd < 0)
+      return "";
+    _close(fd);
+#else
+    std::string name = prefix+"XXXXXX";
+    int fd = mkstemp(&name[0]);
+    if (fd < 0)
+      return "";
+    // mkstemp() creates the file as 0600; the cache is for everyone
+    fchmod(fd,0644);
+    close(fd);
+#endif
+    return name;
+  }
+
+  static void saveCache(const std::string &fileName, const Mesh::SP &mesh)
+  {
+    MeshCacheHeader header;
+    header.magic = meshCacheMagic;
+    header.version = meshCacheVersion;
+    if (!sourceStamp(fileName,header.sourceSize,header.sourceTime))
+      return;
+    header.bounds = mesh->bounds;
+    header.numGeoms = mesh->geoms.size();
+
+    std::vector<uint64_t> sizes;
+    for (auto &geom : mesh->geoms) {
+      sizes.push_back(geom->vertex.size());
+      sizes.push_back(geom->index.size());
+    }
+
+    header.checksum = checksum(sizes.data(),sizeof(uint64_t)*sizes.size());
+    for (auto &geom : mesh->geoms) {
+      header.checksum = checksum(geom->vertex.data(),
+                                 sizeof(float3)*geom->vertex.size(),
+                                 header.checksum);
+      header.checksum = checksum(geom->index.data(),
+                                 sizeof(int3)*geom->index.size(),
+                                 header.checksum);
+    }
+
+    // Write to a temporary file first so concurrent readers (e.g.,
+    // MPI ranks) never see a partial cache; the name is unique even
+    // if ranks on different hosts of a shared file system write
+    std::string cacheFile = cacheFileName(fileName);
+    std::string tmpFile = createTempFile(cacheFile+".tmp");
+    if (tmpFile.empty())
+      return; // e.g., read-only directory; no cache then
+    {
+      std::ofstream out(tmpFile,std::ios::binary|std::ios::trunc);
+      out.write((const char *)&header,sizeof(header));
+      out.write((const char *)sizes.data(),sizeof(uint64_t)*sizes.size());
+      for (auto &geom : mesh->geoms) {
+        out.write((const char *)geom->vertex.data(),sizeof(float3)*geom->vertex.size());
+        out.write((const char *)geom->index.data(),sizeof(int3)*geom->index.size());
+      }
+      if (!out.good()) {
+        out.close();
+        std::remove(tmpFile.c_str());
+        return;
+      }
+    }
+
+    std::error_code ec;
+    std::filesystem::rename(tmpFile,cacheFile,ec);
+    if (ec)
+      std::remove(tmpFile.c_str());
+  }
+
   Mesh::SP Mesh::load(std::string fileName) {
+    Mesh::SP res = loadCache(fileName);
+    if (res)
+      return res;
+
     if (getExt(fileName)==".obj") {
-      return loadOBJ(fileName);
+      res = loadOBJ(fileName);
     } else if (getExt(fileName)==".mini") {
-      return loadMini(fileName);
+      res = loadMini(fileName);
     }
-    return NULL;
+
+    if (res)
+      saveCache(fileName,res);
+
+    return res;
   }
 }
@@ -18,10 +18,18 @@
 
 // std
 #include <float.h>
+#include <string.h>
+#include <math.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <algorithm>
 #include <memory>
 #include <string>
+#include <type_traits>
 #include <vector>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 #include "FileMapping.h"
 // anari
 #include "anari/anari_cpp/ext/linalg.h"
@@ -36,10 +44,47 @@ namespace util {
   using box3i = anari::math::box3i;
   using int3 = anari::math::int3;
 
+  // ======================================================
+  // Bricked volume files (.bvol):
+  //   BrickedVolumeHeader,
+  //   bricks of brickSize^3 voxels (zero-padded at the
+  //   upper boundaries), voxels in x-y-z order per brick,
+  //   bricks in Morton order of their brick coordinates
+  // Subvolumes can then be read with a few contiguous
+  // reads per brick, instead of one per scanline
+  // ======================================================
+
+  static const uint64_t bvolFileMagic = 0x4c4f565259455553ull; // "SUEYRVOL"
+  static const uint64_t bvolFileVersion = 1;
+
+  struct BrickedVolumeHeader {
+    uint64_t magic;
+    uint64_t version;
+    int3 dims;
+    int32_t bpc;
+    int32_t brickSize;
+    int32_t pad;
+  };
+
+  inline uint64_t mortonCode(const int3 p)
+  {
+    auto spread = [](uint64_t x) {
+      x &= 0x1fffff;
+      x = (x | x << 32) & 0x1f00000000ffffull;
+      x = (x | x << 16) & 0x1f0000ff0000ffull;
+      x = (x | x << 8)  & 0x100f00f00f00f00full;
+      x = (x | x << 4)  & 0x10c30c30c30c30c3ull;
+      x = (x | x << 2)  & 0x1249249249249249ull;
+      return x;
+    };
+    return spread(p.x) | spread(p.y) << 1 | spread(p.z) << 2;
+  }
+
   struct Volume {
     typedef std::shared_ptr<Volume> SP;
 
     Volume() = default;
+    // Raw volume, voxels in x-y-z order
     Volume(std::string fileName, const int3 dims, int bpc)
       : fileName(fileName)
       , file(fileName)
@@ -49,60 +94,163 @@ namespace util {
       // fp = fopen(fileName.c_str(),"rb");
     }
 
-    const float* get(const int3 first, const int3 last,
-                     box1 *valueRange = NULL)
+    // Bricked volume (.bvol); dims and bpc come from the header
+    Volume(std::string fileName)
+      : fileName(fileName)
+      , file(fileName)
+      , dims(0)
+      , bpc(0)
     {
-      // if (fp == NULL || bpc == 0)
-      //   return NULL;
+      BrickedVolumeHeader header;
+      if (file.fm.nbytes() < sizeof(header))
+        return;
+      memcpy(&header,file.fm.data(),sizeof(header));
+      if (header.magic != bvolFileMagic
+       || header.version != bvolFileVersion
+       || header.brickSize <= 0)
+        return;
 
-      if (dims == int3(0))
-        return NULL;
+      dims = header.dims;
+      bpc = header.bpc;
+      brickSize = header.brickSize;
+      dataOffset = sizeof(header);
+      computeBrickOrder();
+    }
 
-      if (bpc != 1 && bpc != 2 && bpc != 4)
-        return NULL;
+    bool bricked() const
+    { return brickSize > 0; }
 
+    int3 numBricks() const
+    { return (dims+int3(brickSize-1))/int3(brickSize); }
+
+    // Write the volume in the bricked layout
+    bool saveBricked(const std::string &fn, int newBrickSize) const
+    {
+      if (dims == int3(0) || newBrickSize <= 0 || !fileLargeEnough())
+        return false;
+
+      FILE *fp = fopen(fn.c_str(),"wb");
+      if (!fp)
+        return false;
+
+      BrickedVolumeHeader header;
+      header.magic = bvolFileMagic;
+      header.version = bvolFileVersion;
+      header.dims = dims;
+      header.bpc = bpc;
+      header.brickSize = newBrickSize;
+      header.pad = 0;
+      bool ok = fwrite(&header,sizeof(header),1,fp) == 1;
+
+      int3 nb = (dims+int3(newBrickSize-1))/int3(newBrickSize);
+      std::vector<uint32_t> order = mortonBrickOrder(nb);
+
+      size_t bs = newBrickSize;
+      std::vector<char> brick(bs*bs*bs*bpc);
+      for (size_t i=0; i<order.size() && ok; ++i) {
+        int3 lower = brickCoord(order[i],nb)*newBrickSize;
+        int3 upper = min(lower+int3(newBrickSize),dims);
+        std::fill(brick.begin(),brick.end(),0);
+        for (int z=lower.z; z<upper.z; ++z) {
+          for (int y=lower.y; y<upper.y; ++y) {
+            size_t src = (z * dims.x * size_t(dims.y) + size_t(y) * dims.x + lower.x)*bpc;
+            size_t dst = ((z-lower.z)*bs*bs+(y-lower.y)*bs)*bpc;
+            memcpy(brick.data()+dst,file.fm.data()+src,(upper.x-lower.x)*size_t(bpc));
+          }
+        }
+        ok = fwrite(brick.data(),brick.size(),1,fp) == 1;
+      }
+
+      fclose(fp);
+      return ok;
+    }
+
+    const float* get(const int3 first, const int3 last,
+                     box1 *valueRange = NULL)
+    {
       int3 range = last-first;
       size_t numVoxels = range.x*size_t(range.y)*range.z;
       voxelBuffer.resize(numVoxels);
 
-      // Read line by line and convert
-      std::vector<char> readBuffer(range.x*bpc);
+      if (!get(first,last,voxelBuffer.data(),valueRange))
+        return NULL;
+
+      return voxelBuffer.data();
+    }
+
+    // Convert the voxels in [first,last) to normalized floats, written
+    // to dst (which must hold all of them). Does not use voxelBuffer,
+    // so it is safe to call concurrently with different dst
+    bool get(const int3 first, const int3 last, float *dst,
+             box1 *valueRange = NULL) const
+    {
+      if (dims == int3(0))
+        return false;
+
+      if (bpc != 1 && bpc != 2 && bpc != 4)
+        return false;
+
+      if (!fileLargeEnough())
+        return false;
 
-      size_t voxelOff = 0;
       box1 vr(FLT_MAX,-FLT_MAX);
-      for (int z=first.z; z!=last.z; ++z) {
-        for (int y=first.y; y!=last.y; ++y, voxelOff += range.x) {
-          size_t firstVoxel = z * dims.x * size_t(dims.y) + size_t(y) * dims.x + first.x;
-          file.seek(firstVoxel*bpc);
-          file.read(readBuffer.data(),readBuffer.size());
-          // fseek(fp,firstVoxel*bpc,SEEK_SET);
-          // fread(readBuffer.data(),1,readBuffer.size(),fp);
-
-          for (int ix=0; ix<range.x; ++ix) {
-            float value = 0.f;
-            if (bpc == 1)
-              value = (unsigned char)(readBuffer[ix])/255.f;
-            else if (bpc == 2) {
-              char bytes[2] = {readBuffer[ix*2],readBuffer[ix*2+1]};
-              value = (*((unsigned short*)bytes))/65535.f;
-            } else if (bpc == 4) {
-              char bytes[4] = {readBuffer[ix*4],readBuffer[ix*4+1],
-                               readBuffer[ix*4+2],readBuffer[ix*4+3]};
-              value = *((float*)bytes);
-            }
-            voxelBuffer[voxelOff+ix] = value;
-            vr.extend(value);
-          }
-        }
+      if (bpc == 1)
+        convert<uint8_t>(first,last,dst,255.f,vr);
+      else if (bpc == 2)
+        convert<uint16_t>(first,last,dst,65535.f,vr);
+      else
+        convert<float>(first,last,dst,1.f,vr);
+
+      if (valueRange != NULL) {
+        valueRange->extend(vr);
       }
 
+      return true;
+    }
+
+    // Like get(), but copies the voxels in their native type (bpc
+    // bytes each); valueRange is still in normalized floats
+    bool getNative(const int3 first, const int3 last, void *dst,
+                   box1 *valueRange = NULL) const
+    {
+      if (dims == int3(0))
+        return false;
+
+      if (bpc != 1 && bpc != 2 && bpc != 4)
+        return false;
+
+      if (!fileLargeEnough())
+        return false;
+
+      box1 vr(FLT_MAX,-FLT_MAX);
+      if (bpc == 1)
+        convert<uint8_t>(first,last,(uint8_t *)dst,255.f,vr);
+      else if (bpc == 2)
+        convert<uint16_t>(first,last,(uint16_t *)dst,65535.f,vr);
+      else
+        convert<float>(first,last,(float *)dst,1.f,vr);
+
       if (valueRange != NULL) {
         valueRange->extend(vr);
       }
 
-      return voxelBuffer.data();
+      return true;
     }
 
+    // Convert n voxels with bpc bytes each to normalized floats
+    static bool toFloat(const void *src, int bpc, float *dst, size_t n)
+    {
+      box1 vr(FLT_MAX,-FLT_MAX);
+      if (bpc == 1)
+        convertLine((const uint8_t *)src,dst,n,255.f,vr);
+      else if (bpc == 2)
+        convertLine((const uint16_t *)src,dst,n,65535.f,vr);
+      else if (bpc == 4)
+        convertLine((const float *)src,dst,n,1.f,vr);
+      else
+        return false;
+      return true;
+    }
     const float* get(box3i cellRange, box1 *valueRange = NULL)
     {
       return get(cellRange.lower,cellRange.upper,valueRange);
@@ -110,10 +258,232 @@ namespace util {
 
     std::vector<float> voxelBuffer;
 
+  private:
+    bool fileLargeEnough() const
+    {
+      if (bricked()) {
+        size_t bs = brickSize;
+        return dataOffset+brickOrder.size()*bs*bs*bs*bpc <= file.fm.nbytes();
+      }
+      return dims.x*size_t(dims.y)*dims.z*bpc <= file.fm.nbytes();
+    }
+
+    static int3 brickCoord(size_t linearBrickID, const int3 nb)
+    {
+      return int3(int(linearBrickID%nb.x),
+                  int(linearBrickID/nb.x%nb.y),
+                  int(linearBrickID/(size_t(nb.x)*nb.y)));
+    }
+
+    // Linear brick IDs in the order they are stored
+    static std::vector<uint32_t> mortonBrickOrder(const int3 nb)
+    {
+      std::vector<uint32_t> order(nb.x*size_t(nb.y)*nb.z);
+      for (size_t i=0; i<order.size(); ++i)
+        order[i] = (uint32_t)i;
+      std::sort(order.begin(),order.end(),[&](uint32_t a, uint32_t b) {
+        return mortonCode(brickCoord(a,nb)) < mortonCode(brickCoord(b,nb));
+      });
+      return order;
+    }
+
+    void computeBrickOrder()
+    {
+      brickOrder = mortonBrickOrder(numBricks());
+      brickPosition.resize(brickOrder.size());
+      for (size_t i=0; i<brickOrder.size(); ++i)
+        brickPosition[brickOrder[i]] = (uint32_t)i;
+    }
+
+    template <typename T, typename OutT>
+    void convert(const int3 first, const int3 last, OutT *dst,
+                 float norm, box1 &vr) const
+    {
+      if (bricked())
+        convertBricked<T>(first,last,dst,norm,vr);
+      else
+        convertLinear<T>(first,last,dst,norm,vr);
+    }
+
+    // Convert brick by brick; each brick is one contiguous block
+    template <typename T, typename OutT>
+    void convertBricked(const int3 first, const int3 last, OutT *dst,
+                        float norm, box1 &vr) const
+    {
+      const T *bricks = (const T *)(file.fm.data()+dataOffset);
+      int3 range = last-first;
+      int3 nb = numBricks();
+      size_t bs = brickSize;
+      int3 firstBrick = first/int3(brickSize);
+      int3 lastBrick = (last+int3(brickSize-1))/int3(brickSize);
+      for (int bz=firstBrick.z; bz<lastBrick.z; ++bz) {
+        for (int by=firstBrick.y; by<lastBrick.y; ++by) {
+          for (int bx=firstBrick.x; bx<lastBrick.x; ++bx) {
+            size_t linearBrickID = (bz*size_t(nb.y)+by)*nb.x+bx;
+            const T *brick = bricks+brickPosition[linearBrickID]*bs*bs*bs;
+            int3 lower = int3(bx,by,bz)*brickSize;
+            int3 lo = max(first,lower);
+            int3 hi = min(last,lower+int3(brickSize));
+            for (int z=lo.z; z<hi.z; ++z) {
+              for (int y=lo.y; y<hi.y; ++y) {
+                const T *src = brick+((z-lower.z)*bs+(y-lower.y))*bs+(lo.x-lower.x);
+                OutT *d = dst+((z-first.z)*size_t(range.y)+(y-first.y))*range.x+(lo.x-first.x);
+                convertLine(src,d,hi.x-lo.x,norm,vr);
+              }
+            }
+          }
+        }
+      }
+    }
+
+    // Convert line by line, directly from the mapped file
+    template <typename T, typename OutT>
+    void convertLinear(const int3 first, const int3 last, OutT *dst,
+                       float norm, box1 &vr) const
+    {
+      const T *voxels = (const T *)(file.fm.data()+dataOffset);
+      int3 range = last-first;
+      for (int z=first.z; z!=last.z; ++z) {
+        for (int y=first.y; y!=last.y; ++y, dst += range.x) {
+          size_t firstVoxel = z * dims.x * size_t(dims.y) + size_t(y) * dims.x + first.x;
+          convertLine(voxels+firstVoxel,dst,range.x,norm,vr);
+        }
+      }
+    }
+
+    // Output either the normalized value or the source voxel
+    template <typename OutT, typename T>
+    static OutT store(T voxel, float value)
+    {
+      if constexpr (std::is_same<OutT,float>::value)
+        return value;
+      else
+        return voxel;
+    }
+
+    // Branch-free inner loops with per-lane min/max so the compiler
+    // vectorizes them
+    template <typename T, typename OutT>
+    static void convertLine(const T *src, OutT *dst, size_t n,
+                            float norm, box1 &vr)
+    {
+      const int numLanes = 16;
+      const float scale = 1.f/norm;
+      float lo[numLanes], hi[numLanes];
+      for (int l=0; l<numLanes; ++l) {
+        lo[l] = vr.lower;
+        hi[l] = vr.upper;
+      }
+
+      size_t i = 0;
+      for (; i+numLanes<=n; i+=numLanes) {
+        for (int l=0; l<numLanes; ++l) {
+          float value = float(src[i+l])*scale;
+          dst[i+l] = store<OutT>(src[i+l],value);
+          lo[l] = value < lo[l] ? value : lo[l];
+          hi[l] = value > hi[l] ? value : hi[l];
+        }
+      }
+
+      for (; i<n; ++i) {
+        float value = float(src[i])*scale;
+        dst[i] = store<OutT>(src[i],value);
+        lo[0] = value < lo[0] ? value : lo[0];
+        hi[0] = value > hi[0] ? value : hi[0];
+      }
+
+      for (int l=0; l<numLanes; ++l) {
+        vr.lower = fminf(vr.lower,lo[l]);
+        vr.upper = fmaxf(vr.upper,hi[l]);
+      }
+    }
+
+#if defined(__SSE2__)
+    // Load 16 voxels as floats
+    static void load16(const uint8_t *src, __m128 v[4])
+    {
+      const __m128i zero = _mm_setzero_si128();
+      __m128i b = _mm_loadu_si128((const __m128i *)src);
+      __m128i w0 = _mm_unpacklo_epi8(b,zero);
+      __m128i w1 = _mm_unpackhi_epi8(b,zero);
+      v[0] = _mm_cvtepi32_ps(_mm_unpacklo_epi16(w0,zero));
+      v[1] = _mm_cvtepi32_ps(_mm_unpackhi_epi16(w0,zero));
+      v[2] = _mm_cvtepi32_ps(_mm_unpacklo_epi16(w1,zero));
+      v[3] = _mm_cvtepi32_ps(_mm_unpackhi_epi16(w1,zero));
+    }
+
+    static void load16(const uint16_t *src, __m128 v[4])
+    {
+      const __m128i zero = _mm_setzero_si128();
+      __m128i w0 = _mm_loadu_si128((const __m128i *)src);
+      __m128i w1 = _mm_loadu_si128((const __m128i *)(src+8));
+      v[0] = _mm_cvtepi32_ps(_mm_unpacklo_epi16(w0,zero));
+      v[1] = _mm_cvtepi32_ps(_mm_unpackhi_epi16(w0,zero));
+      v[2] = _mm_cvtepi32_ps(_mm_unpacklo_epi16(w1,zero));
+      v[3] = _mm_cvtepi32_ps(_mm_unpackhi_epi16(w1,zero));
+    }
+
+    static void load16(const float *src, __m128 v[4])
+    {
+      for (int j=0; j<4; ++j)
+        v[j] = _mm_loadu_ps(src+4*j);
+    }
+
+    // SSE2 version for normalized float output (the common case, and
+    // the one that needs the conversion); same results as above
+    template <typename T>
+    static void convertLine(const T *src, float *dst, size_t n,
+                            float norm, box1 &vr)
+    {
+      const __m128 scale = _mm_set1_ps(1.f/norm);
+      __m128 lo = _mm_set1_ps(vr.lower);
+      __m128 hi = _mm_set1_ps(vr.upper);
+
+      size_t i = 0;
+      for (; i+16<=n; i+=16) {
+        __m128 v[4];
+        load16(src+i,v);
+        for (int j=0; j<4; ++j) {
+          v[j] = _mm_mul_ps(v[j],scale);
+          _mm_storeu_ps(dst+i+4*j,v[j]);
+          // returns the second operand if one is NaN, like the
+          // scalar version's comparisons
+          lo = _mm_min_ps(v[j],lo);
+          hi = _mm_max_ps(v[j],hi);
+        }
+      }
+
+      float los[4], his[4];
+      _mm_storeu_ps(los,lo);
+      _mm_storeu_ps(his,hi);
+      for (int l=0; l<4; ++l) {
+        vr.lower = fminf(vr.lower,los[l]);
+        vr.upper = fmaxf(vr.upper,his[l]);
+      }
+
+      const float s = 1.f/norm;
+      for (; i<n; ++i) {
+        float value = float(src[i])*s;
+        dst[i] = value;
+        vr.lower = value < vr.lower ? value : vr.lower;
+        vr.upper = value > vr.upper ? value : vr.upper;
+      }
+    }
+#endif
+
+  public:
+
     std::string fileName;
     MappedFile file;
     int3 dims;
     int bpc;
+
+    // Bricked layout only
+    int brickSize = 0;
+    size_t dataOffset = 0;
+    // Morton order: brick at file position i, and the inverse
+    std::vector<uint32_t> brickOrder;
+    std::vector<uint32_t> brickPosition;
   };
 
 }